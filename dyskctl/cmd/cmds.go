@@ -25,6 +25,10 @@ var (
 	leaseId        string
 	deviceName     string
 	size           uint
+	weight         uint
+	latencyTarget  uint
+	pollUs         uint
+	transport      string
 	vhdFlag        bool
 	readOnlyFlag   bool
 	autoLeaseFlag  bool
@@ -43,6 +47,15 @@ var (
 	storageClassName string
 	arlabels         string
 
+	// heat map args
+	topRegions uint
+
+	// trace/replay args
+	restartFlag    bool
+	fastFlag       bool
+	skipWritesFlag bool
+	replayDepth    uint
+
 	mountCmd = &cobra.Command{
 		Use:   "mount",
 		Short: "mounts a page blob as block device",
@@ -50,7 +63,9 @@ var (
 example:
 
 #Mount an existing page blob
-dyskctl mount --account {acount-name} --key {key} --device-name d01 --container {container-name}`,
+dyskctl mount --account {acount-name} --key {key} --device-name d01 --container {container-name}
+#Mount a 4 GB in memory dysk (no storage account)
+dyskctl mount auto-create --transport ram --size 4 --device-name d01`,
 		Run: func(cmd *cobra.Command, args []string) {
 			validateOutput()
 			mount = true
@@ -266,6 +281,116 @@ dyskctl list`,
 			printDysks(dysks)
 		},
 	}
+
+	statsCmd = &cobra.Command{
+		Use:   "stats",
+		Short: "shows i/o stats of a dysk (mounted on the local host)",
+		Long: `This subcommand shows counters and latency histograms of a single dysk of the local host
+example:
+dyskctl stats --device-name dysk01 --output json`,
+		Run: func(cmd *cobra.Command, args []string) {
+			validateOutput()
+			dyskClient := client.CreateClient("", "", "")
+			s, err := dyskClient.Stats(deviceName)
+
+			if nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+			printStats(s)
+		},
+	}
+
+	heatMapCmd = &cobra.Command{
+		Use:   "heatmap",
+		Short: "shows the hottest regions of a dysk (mounted on the local host)",
+		Long: `This subcommand shows the most accessed regions of a single dysk of the local host.
+The dysk must be mounted while the module heatmap_regions parameter is set
+example:
+dyskctl heatmap --device-name dysk01 --top 10`,
+		Run: func(cmd *cobra.Command, args []string) {
+			validateOutput()
+			dyskClient := client.CreateClient("", "", "")
+			h, err := dyskClient.HeatMap(deviceName)
+
+			if nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+			printHeatMap(h, int(topRegions))
+		},
+	}
+
+	traceCmd = &cobra.Command{
+		Use:   "trace",
+		Short: "saves the i/o trace of a dysk (mounted on the local host)",
+		Long: `This subcommand saves the last requests of a single dysk of the local host to a file (for replay).
+The dysk must be mounted while the module trace_entries parameter is set
+example:
+dyskctl trace --device-name dysk01 --file dysk01.trace
+#start over
+dyskctl trace --device-name dysk01 --restart`,
+		Run: func(cmd *cobra.Command, args []string) {
+			dyskClient := client.CreateClient("", "", "")
+			if restartFlag {
+				if err := dyskClient.RestartTrace(deviceName); nil != err {
+					printError(err)
+					os.Exit(1)
+				}
+				return
+			}
+
+			if 0 == len(filePath) {
+				printError(fmt.Errorf("file is required"))
+				os.Exit(1)
+			}
+
+			t, raw, err := dyskClient.Trace(deviceName)
+			if nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+
+			if err := ioutil.WriteFile(filePath, raw, 0644); nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+			fmt.Printf("%d requests saved (%d recorded since trace start)\n", len(t.Records), t.Recorded)
+		},
+	}
+
+	replayCmd = &cobra.Command{
+		Use:   "replay",
+		Short: "re-issues a saved i/o trace against a dysk (mounted on the local host)",
+		Long: `This subcommand replays a trace saved by dyskctl trace against a dysk of the local host
+and shows latency distribution. Requests are issued with their recorded timing unless --fast is set.
+Write payloads are not traced, replayed writes carry zeros and overwrite target data.
+example:
+dyskctl replay --file dysk01.trace --device-name testdysk01
+dyskctl replay --file dysk01.trace --device-name testdysk01 --fast --depth 32`,
+		Run: func(cmd *cobra.Command, args []string) {
+			validateOutput()
+			raw, err := ioutil.ReadFile(filePath)
+			if nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+
+			t, err := client.ParseTrace(raw)
+			if nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+
+			opts := client.ReplayOptions{Fast: fastFlag, Depth: int(replayDepth), SkipWrites: skipWritesFlag}
+			res, err := client.ReplayTrace(t, "/dev/"+deviceName, opts)
+			if nil != err {
+				printError(err)
+				os.Exit(1)
+			}
+			printReplay(res)
+		},
+	}
 )
 
 func init() {
@@ -282,6 +407,10 @@ func init() {
 	mountCmd.PersistentFlags().BoolVarP(&readOnlyFlag, "read-only", "r", false, "mount dysk as read only")
 	mountCmd.PersistentFlags().BoolVarP(&autoLeaseFlag, "auto-lease", "l", true, "create lease if not provided")
 	mountCmd.PersistentFlags().BoolVarP(&breakLeaseFlag, "break-lease", "b", false, "allow breaking of existing lease while creating")
+	mountCmd.PersistentFlags().UintVarP(&weight, "weight", "w", client.DEFAULT_WEIGHT, "dysk share of worker relative to other dysks (1-1000)")
+	mountCmd.PersistentFlags().UintVar(&latencyTarget, "latency-target-ms", 0, "target request latency in ms, dysk requests are scheduled earliest deadline first (0 for best effort)")
+	mountCmd.PersistentFlags().UintVar(&pollUs, "poll-us", 0, "submitter polls for responses up to this many us, trades cpu for latency (0 for interrupt driven)")
+	mountCmd.PersistentFlags().StringVar(&transport, "transport", string(client.TransportAz), "where data goes: az (page blob), null or ram (in memory, for benchmarking, no storage account needed)")
 
 	// CREATE //
 	createCmd.PersistentFlags().StringVarP(&storageAccountName, "account", "a", "", "Azure storage account name")
@@ -332,6 +461,25 @@ func init() {
 	// LIST //
 	// no args //
 
+	// STATS //
+	statsCmd.PersistentFlags().StringVarP(&deviceName, "device-name", "d", "", "block device name")
+
+	// HEAT MAP //
+	heatMapCmd.PersistentFlags().StringVarP(&deviceName, "device-name", "d", "", "block device name")
+	heatMapCmd.PersistentFlags().UintVarP(&topRegions, "top", "t", 20, "show this many regions, hottest (by bytes) first (0 for all)")
+
+	// TRACE //
+	traceCmd.PersistentFlags().StringVarP(&deviceName, "device-name", "d", "", "block device name")
+	traceCmd.PersistentFlags().StringVarP(&filePath, "file", "f", "", "trace file path")
+	traceCmd.PersistentFlags().BoolVar(&restartFlag, "restart", false, "drop recorded requests and start over")
+
+	// REPLAY //
+	replayCmd.PersistentFlags().StringVarP(&deviceName, "device-name", "d", "", "block device name of target dysk")
+	replayCmd.PersistentFlags().StringVarP(&filePath, "file", "f", "", "trace file path")
+	replayCmd.PersistentFlags().BoolVar(&fastFlag, "fast", false, "issue requests as fast as possible instead of with recorded timing")
+	replayCmd.PersistentFlags().UintVar(&replayDepth, "depth", 64, "requests in flight at most")
+	replayCmd.PersistentFlags().BoolVar(&skipWritesFlag, "skip-writes", false, "replay reads only, target data is kept")
+
 	viper.SetEnvPrefix("dysk")
 	viper.BindPFlag("account", mountCmd.Flags().Lookup("account"))
 	viper.BindPFlag("key", mountCmd.Flags().Lookup("key"))
@@ -345,4 +493,8 @@ func init() {
 	rootCmd.AddCommand(unmountCmd)
 	rootCmd.AddCommand(getCmd)
 	rootCmd.AddCommand(listCmd)
+	rootCmd.AddCommand(statsCmd)
+	rootCmd.AddCommand(heatMapCmd)
+	rootCmd.AddCommand(traceCmd)
+	rootCmd.AddCommand(replayCmd)
 }
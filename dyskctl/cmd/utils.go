@@ -5,6 +5,8 @@ import (
 	"fmt"
 	"math/rand"
 	"os"
+	"sort"
+	"strings"
 	"text/tabwriter"
 
 	"github.com/khenidak/dysk/pkg/client"
@@ -32,7 +34,12 @@ func mount_create() {
 		size = defaultDyskSize
 	}
 
-	if autoCreate {
+	// in memory dysks have no page blob
+	if "" != transport && string(client.TransportAz) != transport {
+		if "" == pageBlobName {
+			pageBlobName = deviceName
+		}
+	} else if autoCreate {
 		if "" == pageBlobName {
 			pageBlobName = deviceName
 		}
@@ -66,6 +73,10 @@ func mount_create() {
 	d.LeaseId = leaseId
 	d.Vhd = vhdFlag
 	d.AccountRealm = storageAccountRealm
+	d.Weight = weight
+	d.LatencyTargetMs = latencyTarget
+	d.PollUs = pollUs
+	d.Transport = client.DyskTransport(transport)
 
 	if mount {
 		err = dyskClient.Mount(&d, autoLeaseFlag, breakLeaseFlag)
@@ -150,3 +161,107 @@ func printDysks(dysks []*client.Dysk) {
 		}
 	}
 }
+
+func printStats(s *client.DyskStats) {
+	if "table" == output_format {
+		w := new(tabwriter.Writer)
+		w.Init(os.Stdout, 24, 2, 0, ' ', 0)
+		fmt.Fprintln(w, "Stat\tRead\tWrite")
+		fmt.Fprintf(w, "ops\t%d\t%d\n", s.Reads, s.Writes)
+		fmt.Fprintf(w, "bytes\t%d\t%d\n", s.ReadBytes, s.WriteBytes)
+		fmt.Fprintf(w, "errors\t%d\t%d\n", s.ReadErrors, s.WriteErrors)
+		for idx := range s.ReadLatencyUs {
+			bound := "inf"
+			if 0 != s.ReadLatencyUs[idx].UpperUs {
+				bound = fmt.Sprintf("%d", s.ReadLatencyUs[idx].UpperUs)
+			}
+			fmt.Fprintf(w, "latency < %sus\t%d\t%d\n", bound, s.ReadLatencyUs[idx].Count, s.WriteLatencyUs[idx].Count)
+		}
+		w.Flush()
+
+		w.Init(os.Stdout, 24, 2, 0, ' ', 0)
+		fmt.Fprintln(w, "Stat\tValue")
+		fmt.Fprintf(w, "resends\t%d\n", s.Resends)
+		fmt.Fprintf(w, "conn failures\t%d\n", s.ConnFailures)
+		fmt.Fprintf(w, "throttles\t%d\n", s.Throttles)
+		fmt.Fprintf(w, "throttled ms\t%d\n", s.ThrottledMs)
+		fmt.Fprintf(w, "timeouts\t%d\n", s.Timeouts)
+		fmt.Fprintf(w, "inflight bytes\t%d\n", s.InflightBytes)
+		fmt.Fprintf(w, "inflight reqs\t%d\n", s.InflightReqs)
+		fmt.Fprintf(w, "connections\t%d\n", s.Connections)
+		fmt.Fprintf(w, "peak connections\t%d\n", s.PeakConnections)
+		w.Flush()
+	} else {
+		enc := json.NewEncoder(os.Stdout)
+		enc.SetIndent("", "    ")
+		err := enc.Encode(s)
+		if nil != err {
+			printError(err)
+		}
+	}
+}
+
+func printHeatMap(h *client.DyskHeatMap, top int) {
+	const barWidth = 40
+	regions := h.Touched
+	sort.SliceStable(regions, func(i, j int) bool { return regions[i].Bytes > regions[j].Bytes })
+	if 0 != top && top < len(regions) {
+		regions = regions[:top]
+	}
+
+	if "table" == output_format {
+		var hottest uint64
+		if 0 != len(regions) {
+			hottest = regions[0].Bytes
+		}
+
+		fmt.Printf("%s: %d of %d regions (%d sectors each) touched\n", h.Name, len(h.Touched), h.Regions, h.RegionSectors)
+		w := new(tabwriter.Writer)
+		w.Init(os.Stdout, 16, 2, 0, ' ', 0)
+		fmt.Fprintln(w, "Sectors\tReads\tWrites\tBytes\tHeat")
+		for _, r := range regions {
+			bar := 0
+			if 0 != hottest {
+				bar = int(r.Bytes * barWidth / hottest)
+			}
+			fmt.Fprintf(w, "%d-%d\t%d\t%d\t%d\t%s\n", r.FirstSector, r.LastSector, r.Reads, r.Writes, r.Bytes, strings.Repeat("#", bar))
+		}
+		w.Flush()
+	} else {
+		h.Touched = regions
+		enc := json.NewEncoder(os.Stdout)
+		enc.SetIndent("", "    ")
+		err := enc.Encode(h)
+		if nil != err {
+			printError(err)
+		}
+	}
+}
+
+func printReplay(r *client.ReplayResult) {
+	if "table" == output_format {
+		mode := "recorded timing"
+		if r.Fast {
+			mode = "fast"
+		}
+
+		fmt.Printf("%s: replayed in %v (%s), %d late, %d skipped\n", r.Device, r.Elapsed, mode, r.Late, r.Skipped)
+		w := new(tabwriter.Writer)
+		w.Init(os.Stdout, 10, 2, 0, ' ', 0)
+		fmt.Fprintln(w, "Op\tCount\tBytes\tErrors\tp50 us\tp90 us\tp99 us\tp99.9 us\tmax us")
+		for _, op := range []struct {
+			name string
+			s    client.LatencySummary
+		}{{"read", r.Read}, {"write", r.Write}} {
+			fmt.Fprintf(w, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", op.name, op.s.Ops, op.s.Bytes, op.s.Errors, op.s.P50Us, op.s.P90Us, op.s.P99Us, op.s.P999Us, op.s.MaxUs)
+		}
+		w.Flush()
+	} else {
+		enc := json.NewEncoder(os.Stdout)
+		enc.SetIndent("", "    ")
+		err := enc.Encode(r)
+		if nil != err {
+			printError(err)
+		}
+	}
+}
@@ -6,22 +6,31 @@
 #include<linux/socket.h>
 #include<linux/in.h>
 #include<linux/net.h>
+#include <linux/tcp.h>
 #include <linux/syscalls.h>
 #include <asm/uaccess.h>
 #include <net/sock.h>
 // Time
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
 // IO
 #include <linux/blkdev.h>
 #include <linux/fs.h>
 // Queue
 #include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+// Params
+#include <linux/moduleparam.h>
 
 #include <linux/slab.h>
 
 #include "dysk_bdd.h"
 #include "dysk_utils.h"
 #include "az.h"
+#include "dysk_trace.h"
 
 #define AZ_SLAB_NAME "dysk_az_reqs"
 
@@ -47,9 +56,19 @@
 #define AUTH_TOKEN_LENGTH      1024 // HMAC(SHA256(StringToSign))
 #define HEADER_LENGTH          1024 // Upstream message header, all headers + token
 #define RESPONSE_HEADER_LENGTH 1024 // Response Header Length // Azure sends on average 592 bytes
+#define REQUEST_ID_LENGTH      64   // x-ms-client-request-id and x-ms-request-id values
+#define AZ_SLOWEST_N           32   // slowest requests kept per dysk (debugfs)
+
+// Fault injection kinds (per dysk, debugfs)
+#define AZ_FAULT_DROP   0 // connection dropped after some bytes
+#define AZ_FAULT_SHORT  1 // socket send/receive cut short
+#define AZ_FAULT_STATUS 2 // response status replaced
+#define AZ_FAULT_DELAY  3 // response held back
+#define AZ_FAULT_ALLOC  4 // allocation failed
+#define AZ_FAULTS       5
 
 // PUT REQUEST HEADER
-//PATH/Sas/HOST/Sas/Lease/ContentLength/Range-Start/Range-End/Date/AccountName/AuthToken
+//PATH/Sas/HOST/Sas/Lease/ContentLength/Range-Start/Range-End/Date/ClientRequestId
 static const char *put_request_head = "PUT %s?comp=page&%s HTTP/1.1\r\n"
                                       "Host: %s\r\n"
                                       "x-ms-lease-id: %s\r\n"
@@ -57,28 +76,31 @@ static const char *put_request_head = "PUT %s?comp=page&%s HTTP/1.1\r\n"
                                       "x-ms-page-write: update\r\n"
                                       "x-ms-range: bytes=%lu-%lu\r\n"
                                       "x-ms-date: %s\r\n"
+                                      "x-ms-client-request-id: %s\r\n"
                                       "UserAgent: dysk/0.0.1\r\n"
                                       "x-ms-version: 2017-04-17\r\n\r\n";
 
 // GET REQUEST HEADER
-//PATH/Sas/HOST/Lease/ContentLength/Range-Start/Range-End/Date/AccountName
+//PATH/Sas/HOST/Lease/ContentLength/Range-Start/Range-End/Date/ClientRequestId
 static const char *get_request_head = "GET %s?%s HTTP/1.1\r\n"
                                       "Host: %s\r\n"
                                       "x-ms-lease-id: %s\r\n"
                                       "Content-Length: %d\r\n"
                                       "x-ms-range: bytes=%lu-%lu\r\n"
                                       "x-ms-date: %s\r\n"
+                                      "x-ms-client-request-id: %s\r\n"
                                       "UserAgent: dysk/0.0.1\r\n"
                                       "x-ms-version: 2017-04-17\r\n\r\n";
 
 // GET REQUEST HEADER (No Lease)
 // Used by readonly disks
-//PATH/Sas/HOST/ContentLength/Range-Start/Range-End/Date/AccountName
+//PATH/Sas/HOST/ContentLength/Range-Start/Range-End/Date/ClientRequestId
 static const char *get_request_head_no_lease = "GET %s?%s HTTP/1.1\r\n"
                                       "Host: %s\r\n"
                                       "Content-Length: %d\r\n"
                                       "x-ms-range: bytes=%lu-%lu\r\n"
                                       "x-ms-date: %s\r\n"
+                                      "x-ms-client-request-id: %s\r\n"
                                       "UserAgent: dysk/0.0.1\r\n"
                                       "x-ms-version: 2017-04-17\r\n\r\n";
 
@@ -88,7 +110,9 @@ static const char *get_request_head_no_lease = "GET %s?%s HTTP/1.1\r\n"
   Each request is represented by __reqstate __resstate both handle
   upstream and downstream data. These objects are allocated on
   a single slab az_slab with GFP_NOIO. Objects they reference
-  all allocated normally via kmalloc + GFP_KERNEL.
+  are allocated via kmalloc + GFP_NOIO, requests are served from
+  writeback/reclaim context (inline in io_request or by worker)
+  and reclaim must not recurse into i/o on the dysk it serves.
 */
 
 // -----------------------------
@@ -96,19 +120,66 @@ static const char *get_request_head_no_lease = "GET %s?%s HTTP/1.1\r\n"
 // ----------------------------
 // for __reqstate __resstate allocation for *all dysks*.
 struct kmem_cache *az_slab;
+// storage accounts currently used by mounted dysks
+static LIST_HEAD(az_accounts);
+static DEFINE_SPINLOCK(az_accounts_lock);
+// endpoints currently used by mounted dysks
+static LIST_HEAD(az_endpoints);
+static DEFINE_MUTEX(az_endpoints_lock);
+// open sockets across all endpoints
+static atomic_t az_total_connections = ATOMIC_INIT(0);
+
+// idle sockets are closed after this many seconds (0 keeps them open)
+static unsigned int idle_timeout_secs = 60;
+module_param(idle_timeout_secs, uint, 0644);
+MODULE_PARM_DESC(idle_timeout_secs, "Seconds before an idle connection to storage is closed (0 never)");
+
+static void az_reap_idle_connections(struct work_struct *work);
+static DECLARE_DELAYED_WORK(az_reaper, az_reap_idle_connections);
 
 #define MAX_CONNECTIONS       64  // Max concurrent conenctions
 #define ERR_FAILED_CONNECTION -999 // Used to signal inability to connection to server
 #define MAX_TRY_CONNECT       3    // Defines the max # of attempt to connect, will signal catastrohpe after
+#define AZ_NOMEM_RETRY_DELAY  (HZ / 100) // back off when memory is short
+#define AZ_CONN_RETRY_DELAY   1 // (jiffies) no connection available, they free up as responses arrive
+
+// Storage account governor (shared by all dysks on the same host)
+#define ACCOUNT_MAX_CONNECTIONS 256 // Max open sockets against one account
+#define ACCOUNT_MAX_INFLIGHT    192 // Max requests on the wire against one account
+#define ACCOUNT_THROTTLE_DEFAULT jiffies + (HZ / 10)
+
+// Endpoints (host:ip:port) shared by dysks
+#define ENDPOINT_MAX_IDLE        1024 // idle sockets kept per endpoint
+#define AZ_MAX_TOTAL_CONNECTIONS 4096 // module wide max open sockets
+#define CONN_DYSK_RESERVED       4    // sockets a dysk can always have, even when caps are reached
+
+// Idle connections
+#define AZ_REAPER_INTERVAL       (5 * HZ) // how often idle sockets are checked
+#define CONN_KEEPALIVE_INTERVAL  5        // seconds between keepalive probes
+#define CONN_KEEPALIVE_COUNT     3        // failed probes before socket is dead
+
+// Connection lanes (per dysk pool)
+#define CONN_LANE_SMALL       0            // small requests, latency sensitive
+#define CONN_LANE_BULK        1            // large transfers
+#define CONN_LANES            2
+#define CONN_SMALL_READ_MAX   (128 * 1024) // reads up to this size go in small lane
+#define CONN_SMALL_WRITE_MAX  (64 * 1024)  // writes up to this size go in small lane
+#define CONN_SMALL_RESERVED   16           // connections bulk lane can not take from small lane
 
 // Reason why the connection is returning to pool
 typedef enum put_connection_reason  put_connection_reason;
+// Per storage account governor, shared across dysks
+typedef struct az_account az_account;
+// Idle sockets against one host:ip:port, shared across dysks
+typedef struct az_endpoint az_endpoint;
 // Manages a pool of connections (sockets)
 typedef struct connection_pool connection_pool;
 // Represents a socket.
 typedef struct connection connection;
 // entire module state attached to each dysk
 typedef struct az_state az_state;
+// faults injected into a dysk's requests
+typedef struct az_faults az_faults;
 
 // Request Mgmt
 typedef struct __reqstate __reqstate;       // Send state (Task)
@@ -125,13 +196,80 @@ enum put_connection_reason {
   connection_failed = 1 << 0,
   connection_ok     = 1 << 1
 };
-struct connection_pool {
-  // Used to maintain # of active of connections
-  struct kfifo connection_queue;
+/*
+ Dysks sharing a storage account (host) share its request rate
+ limits. The account tracks totals across all dysks, and is used
+ to cap connections and requests on the wire. In flight requests
+ are split evenly across the dysks that currently have work on the
+ wire. A throttle response on one dysk holds off new requests on
+ all of its siblings.
+*/
+struct az_account {
+  // host name used as key
+  char host[HOST_LEN];
+  // # of dysks using this account
+  unsigned int refs;
+  // open sockets across all dysks
+  atomic_t connections;
+  // checked out connections (requests on the wire) across all dysks
+  atomic_t inflight;
+  // # of dysks with at least one request on the wire
+  atomic_t active;
+  // account throttling (jiffies)
+  unsigned long throttle_until;
+  // Linked list pluming
+  struct list_head list;
+};
+
+/*
+ Idle sockets are kept per endpoint and reused by any dysk mounted
+ against it, a newly mounted dysk starts with warm connections.
+ Total sockets are capped per account and module wide, yet each dysk
+ can always have CONN_DYSK_RESERVED connections.
+
+ Sockets idle for longer than idle_timeout_secs are closed, before the
+ server resets them under us. Quiet dysks therefore hold no sockets, the
+ next request opens a new one. Sockets use tcp keepalive, and are checked
+ before they are handed to a request so half-dead ones never cost a
+ failed request.
+*/
+struct az_endpoint {
+  // host, ip and port used as key
+  char host[HOST_LEN];
+  char ip[IP_LEN];
+  int port;
+  // # of dysks using this endpoint
+  unsigned int refs;
   // Address used by all sockets
-  struct sockaddr_in *server;
-  // count of connection
-  unsigned int count;
+  struct sockaddr_in server;
+  // idle sockets
+  struct kfifo idle;
+  // used for add/remove to idle sockets
+  spinlock_t lock;
+  // account this endpoint belongs to
+  az_account *account;
+  // Linked list pluming
+  struct list_head list;
+};
+
+/*
+ Per dysk view of its endpoint. Sockets in a pool are interchangeable
+ but the pool capacity is split in lanes. Small requests (mostly reads)
+ are never left waiting behind large transfers: the bulk lane can't
+ take the last CONN_SMALL_RESERVED connections, while the small lane
+ can borrow any spare capacity.
+*/
+struct connection_pool {
+  // endpoint that owns idle sockets
+  az_endpoint *endpoint;
+  // # of connections checked out of this pool
+  unsigned int inflight;
+  // max inflight seen
+  unsigned int peak;
+  // # of connections checked out per lane
+  unsigned int lane_inflight[CONN_LANES];
+  // counters are updated by worker and by inline submission
+  spinlock_t lock;
   // State
   az_state *azstate;
 };
@@ -139,11 +277,66 @@ struct connection_pool {
 struct connection {
   // Actual socket
   struct socket *sockt;
+  // lane this connection was checked out for
+  int lane;
+  // returned to idle queue on (jiffies)
+  unsigned long idle_since;
+  // socket busy poll (us) as created, restored once back in idle queue
+  unsigned int ll_usec_default;
+};
+
+// a completed request and where its time went
+struct az_slow_req {
+  char client_request_id[REQUEST_ID_LENGTH];
+  char server_request_id[REQUEST_ID_LENGTH];
+  sector_t sector;
+  unsigned int bytes;
+  int dir;
+  int attempt;
+  int status;
+  time64_t completed_on;  // wall clock (seconds)
+  u64 total_ns;           // accepted to completed, all attempts
+  u64 send_ns;            // accepted to on the wire (queueing, connection, send)
+  u64 wait_ns;            // on the wire to first response byte
+  u64 receive_ns;         // first to last response byte
+};
+
+/*
+ Faults are injected into a dysk's requests to exercise recovery paths
+ (re-sends, throttling, resuming partial i/o, timeouts) on demand. Knobs
+ are u32 files in /sys/kernel/debug/dysk/<dysk>/faults/, all 0 (off) by
+ default. An "every" knob of N injects the fault on every Nth chance.
+ Knobs are read racy, a change applies to chances that come after it.
+*/
+struct az_faults {
+  u32 drop_every;       // drop the connection of every Nth attempt
+  u32 drop_after_bytes; // once this many bytes were sent and received on it
+  u32 short_io_bytes;   // hand at most this many bytes to each socket send/receive
+  u32 status_every;     // replace status of every Nth response
+  u32 status_code;      // with this one (429, 500 or 503, others are taken as 503)
+  u32 delay_every;      // hold every Nth response
+  u32 delay_ms;         // for this long before it is processed
+  u32 alloc_fail_every; // fail every Nth allocation of request state and buffers
+  // chances and injected faults, per kind
+  atomic_t chances[AZ_FAULTS];
+  atomic_t injected[AZ_FAULTS];
+  struct dentry *dir;
 };
 
 struct az_state {
   // Connection pool used by this dysk
   connection_pool *pool;
+  // sequence used for client request ids
+  atomic64_t request_seq;
+  // slowest requests, slow_count are used
+  struct az_slow_req slowest[AZ_SLOWEST_N];
+  int slow_count;
+  spinlock_t slow_lock;
+  struct dentry *slowest_file;
+  // Storage account this dysk belongs to
+  az_account *account;
+  // fault injection
+  az_faults faults;
   // this dysk
   dysk *d;
 };
@@ -156,12 +349,20 @@ struct az_state {
 struct __reqstate {
   // Caller set state //
   az_state *azstate;    // module state
-  struct request *req;  // current request
+  struct request *req;  // current request (first of span)
+  struct request *span[DYSK_SPAN_MAX]; // requests served by this one
+  int span_count;
 
   // reentrancy state  //
   connection *c;        // connection used for request
   __resstate *resstate; // response state
   int try_new_request;  // flagged when we retry from the top
+  int attempt;          // times this request was re-sent
+  u64 start_ns;         // accepted on (stats)
+  u64 sent_ns;          // current attempt is on the wire
+  char client_request_id[REQUEST_ID_LENGTH]; // current attempt
+  int fault_drop;       // connection of current attempt is to be dropped (fault)
+  size_t wire_bytes;    // sent on current attempt
 
   // Header message
   struct msghdr *header_msg;
@@ -179,7 +380,9 @@ struct __reqstate {
 struct __resstate {
   // Caller set state
   az_state *azstate;    // module state
-  struct request *req;  // current request
+  struct request *req;  // current request (first of span)
+  struct request *span[DYSK_SPAN_MAX]; // requests served by this one
+  int span_count;
   connection *c;        // conenction used in the send part
 
   // reentrancy state //
@@ -189,6 +392,15 @@ struct __resstate {
   struct msghdr *msg;           // Message used to receive
   __reqstate *reqstate;         // if we are retrying we will need to issue new request with this
   int try_new_request;          // flag will be set if connection failed, retryable/throttle request
+  int attempt;                  // times this request was re-sent
+  u64 start_ns;                 // accepted on (stats)
+  u64 sent_ns;                  // request was on the wire
+  u64 first_byte_ns;            // response started
+  char client_request_id[REQUEST_ID_LENGTH];
+  int fault_drop;               // connection is to be dropped (fault)
+  size_t wire_bytes;            // sent and received on this attempt
+  int fault_delayed;            // response is held back (fault)
+  unsigned long fault_until;    // until (jiffies)
 };
 
 struct http_response {
@@ -206,8 +418,143 @@ struct http_response {
   char status[256];
 };
 
+//  Storage Account Governor
+//  -------------------------
+// finds or creates the account for a host, takes a ref
+static az_account *az_account_get(char *host)
+{
+  az_account *account = NULL;
+  az_account *existing;
+  spin_lock(&az_accounts_lock);
+  list_for_each_entry(existing, &az_accounts, list) {
+    if (0 == strncmp(existing->host, host, HOST_LEN)) {
+      account = existing;
+      break;
+    }
+  }
+
+  if (!account) {
+    account = kmalloc(sizeof(az_account), GFP_ATOMIC);
+
+    if (!account) goto done;
+
+    memset(account, 0, sizeof(az_account));
+    memcpy(account->host, host, strnlen(host, HOST_LEN - 1));
+    atomic_set(&account->connections, 0);
+    atomic_set(&account->inflight, 0);
+    atomic_set(&account->active, 0);
+    list_add(&account->list, &az_accounts);
+  }
+
+  account->refs++;
+done:
+  spin_unlock(&az_accounts_lock);
+  return account;
+}
+
+// drops a ref, the last dysk out frees the account
+static void az_account_put(az_account *account)
+{
+  if (!account) return;
+
+  spin_lock(&az_accounts_lock);
+  account->refs--;
+
+  if (0 == account->refs) {
+    list_del(&account->list);
+    kfree(account);
+  }
+
+  spin_unlock(&az_accounts_lock);
+}
+
+// jiffies left until account throttling is over
+static unsigned long az_account_throttle_left(az_account *account)
+{
+  unsigned long until = account->throttle_until;
+  return (0 != until && time_before(jiffies, until)) ? until - jiffies : 0;
+}
+
+// is the entire account being throttled
+static int az_account_throttled(az_account *account)
+{
+  unsigned long until = account->throttle_until;
+
+  if (0 == until) return 0;
+
+  if (time_after(jiffies, until)) {
+    account->throttle_until = 0;
+    printk(KERN_INFO "dysk: account %s throttling is completed", account->host);
+    return 0;
+  }
+
+  return 1;
+}
+
+// a throttle response on one dysk applies to all dysks on this account
+static void az_account_throttle(az_account *account)
+{
+  if (0 != account->throttle_until) return;
+
+  account->throttle_until = ACCOUNT_THROTTLE_DEFAULT;
+  printk(KERN_INFO "dysk: account %s is entering throttling mode", account->host);
+}
+
+// can this pool put one more request on the wire
+static int az_account_may_dispatch(az_account *account, connection_pool *pool)
+{
+  int active = 0;
+  int share  = 0;
+
+  if (ACCOUNT_MAX_INFLIGHT <= atomic_read(&account->inflight)) return 0;
+
+  // fair share is computed across dysks that have requests on the wire
+  // counting this pool if it is about to become active
+  active = atomic_read(&account->active) + ((0 == pool->inflight) ? 1 : 0);
+  share  = ACCOUNT_MAX_INFLIGHT / (active > 0 ? active : 1);
+
+  if (0 == share) share = 1;
+
+  return (pool->inflight < share) ? 1 : 0;
+}
+
 //  Connection Pool Mgmt
 //  -------------------------
+// first byte and length of the range covered by a span
+static void span_range(struct request **span, int span_count, size_t *start, size_t *bytes)
+{
+  struct request *last = span[span_count - 1];
+  *start = ((u64) blk_rq_pos(span[0]) << 9);
+  *bytes = ((u64) blk_rq_pos(last) << 9) + blk_rq_bytes(last) - *start;
+}
+
+// Lane of a span, by bytes its ranged request covers (gaps included) and direction
+static int connection_lane(struct request **span, int span_count)
+{
+  size_t start = 0;
+  size_t bytes = 0;
+  span_range(span, span_count, &start, &bytes);
+
+  if (READ == rq_data_dir(span[0]))
+    return (CONN_SMALL_READ_MAX >= bytes) ? CONN_LANE_SMALL : CONN_LANE_BULK;
+
+  return (CONN_SMALL_WRITE_MAX >= bytes) ? CONN_LANE_SMALL : CONN_LANE_BULK;
+}
+
+// can lane take one more connection
+static int connection_lane_may_dispatch(connection_pool *pool, int lane)
+{
+  unsigned int reserved = 0;
+
+  if (CONN_LANE_SMALL == lane) return 1;
+
+  // keep what small lane is not using out of its reservation
+  if (CONN_SMALL_RESERVED > pool->lane_inflight[CONN_LANE_SMALL])
+    reserved = CONN_SMALL_RESERVED - pool->lane_inflight[CONN_LANE_SMALL];
+
+  return ((pool->inflight + reserved) < MAX_CONNECTIONS) ? 1 : 0;
+}
+
 // closes a connection
 static void connection_teardown(connection *c)
 {
@@ -221,6 +568,21 @@ static void connection_teardown(connection *c)
     kfree(c);
   }
 }
+
+// Probe idle connections so dead peers are found before we use them
+static void connection_keepalive(struct socket *sockt)
+{
+  int on       = 1;
+  int idle     = (0 != idle_timeout_secs && idle_timeout_secs < 60) ? idle_timeout_secs : 60;
+  int interval = CONN_KEEPALIVE_INTERVAL;
+  int count    = CONN_KEEPALIVE_COUNT;
+  // failure to set any is not fatal, liveness is also checked before use
+  kernel_setsockopt(sockt, SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
+  kernel_setsockopt(sockt, SOL_TCP, TCP_KEEPIDLE, (char *) &idle, sizeof(idle));
+  kernel_setsockopt(sockt, SOL_TCP, TCP_KEEPINTVL, (char *) &interval, sizeof(interval));
+  kernel_setsockopt(sockt, SOL_TCP, TCP_KEEPCNT, (char *) &count, sizeof(count));
+}
+
 // Creates a connection
 static int connection_create(connection_pool *pool, connection **c)
 {
@@ -235,7 +597,7 @@ static int connection_create(connection_pool *pool, connection **c)
   if (0 != sock_create(AF_INET, SOCK_STREAM, IPPROTO_TCP, &sockt)) goto failed;
 
   while (connection_attempt <= MAX_TRY_CONNECT) {
-    if (0 != (success =  sockt->ops->connect(sockt, (struct sockaddr *)pool->server, sizeof(struct sockaddr_in), 0))) {
+    if (0 != (success =  sockt->ops->connect(sockt, (struct sockaddr *) &pool->endpoint->server, sizeof(struct sockaddr_in), 0))) {
       if (-ENOMEM == success) goto failed; // if no memory try later
 
       // Anything else is subject to max try connection
@@ -254,7 +616,12 @@ static int connection_create(connection_pool *pool, connection **c)
     break; // connected
   }
 
-  newcon->sockt = sockt;
+  connection_keepalive(sockt);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+  newcon->ll_usec_default = sockt->sk->sk_ll_usec;
+#endif
+  newcon->sockt      = sockt;
+  newcon->idle_since = 0; // never been idle
   *c            = newcon;
   return success;
 failed:
@@ -262,111 +629,286 @@ failed:
   return success;
 }
 
-// How many connections are in pool
-static unsigned int connection_pool_count(connection_pool *pool)
+// is an idle connection still usable
+static int connection_is_alive(connection *c)
+{
+  struct sock *sk = c->sockt->sk;
+
+  if (TCP_ESTABLISHED != sk->sk_state) return 0;
+
+  if (0 != sk->sk_err || (sk->sk_shutdown & RCV_SHUTDOWN)) return 0;
+
+  // nothing is expected on an idle connection (server is closing it)
+  if (!skb_queue_empty(&sk->sk_receive_queue)) return 0;
+
+  return 1;
+}
+
+// sockets accounting (endpoint, account and module wide)
+static void endpoint_connection_opened(az_endpoint *ep)
+{
+  atomic_inc(&ep->account->connections);
+  atomic_inc(&az_total_connections);
+}
+
+static void endpoint_connection_closed(az_endpoint *ep)
+{
+  atomic_dec(&ep->account->connections);
+  atomic_dec(&az_total_connections);
+}
+
+// finds or creates the endpoint for a dysk, takes a ref
+static az_endpoint *az_endpoint_get(dysk *d)
+{
+  az_endpoint *ep = NULL;
+  az_endpoint *existing;
+  mutex_lock(&az_endpoints_lock);
+  list_for_each_entry(existing, &az_endpoints, list) {
+    if (d->def->port == existing->port &&
+        0 == strncmp(existing->ip, d->def->ip, IP_LEN) &&
+        0 == strncmp(existing->host, d->def->host, HOST_LEN)) {
+      ep = existing;
+      break;
+    }
+  }
+
+  if (!ep) {
+    ep = kmalloc(sizeof(az_endpoint), GFP_KERNEL);
+
+    if (!ep) goto done;
+
+    memset(ep, 0, sizeof(az_endpoint));
+    memcpy(ep->host, d->def->host, strnlen(d->def->host, HOST_LEN - 1));
+    memcpy(ep->ip, d->def->ip, strnlen(d->def->ip, IP_LEN - 1));
+    ep->port                   = d->def->port;
+    ep->server.sin_family      = AF_INET;
+    ep->server.sin_addr.s_addr = inet_addr(ep->ip);
+    ep->server.sin_port        = htons(ep->port);
+    spin_lock_init(&ep->lock);
+
+    if (0 != kfifo_alloc(&ep->idle, sizeof(connection *) * ENDPOINT_MAX_IDLE, GFP_KERNEL)) {
+      printk(KERN_INFO  "dysk failed to create connection pool for %s", ep->host);
+      kfree(ep);
+      ep = NULL;
+      goto done;
+    }
+
+    if (NULL == (ep->account = az_account_get(ep->host))) {
+      kfifo_free(&ep->idle);
+      kfree(ep);
+      ep = NULL;
+      goto done;
+    }
+
+    list_add(&ep->list, &az_endpoints);
+  }
+
+  ep->refs++;
+done:
+  mutex_unlock(&az_endpoints_lock);
+  return ep;
+}
+
+// drops a ref, the last dysk out closes idle sockets
+static void az_endpoint_put(az_endpoint *ep)
+{
+  connection *c = NULL;
+
+  if (!ep) return;
+
+  mutex_lock(&az_endpoints_lock);
+  ep->refs--;
+
+  if (0 == ep->refs) {
+    list_del(&ep->list);
+
+    // Close and destroy all the connections
+    while (sizeof(connection *) == kfifo_out_spinlocked(&ep->idle, &c, sizeof(connection *), &ep->lock)) {
+      connection_teardown(c);
+      c = NULL;
+      endpoint_connection_closed(ep);
+    }
+
+    kfifo_free(&ep->idle); // free the queue
+    az_account_put(ep->account);
+    kfree(ep);
+  }
+
+  mutex_unlock(&az_endpoints_lock);
+}
+
+// can this dysk open one more socket
+static int connection_may_connect(connection_pool *pool)
 {
-  unsigned int sizebytes = kfifo_len(&pool->connection_queue);
-  unsigned int actual = sizebytes / sizeof(connection *);
-  return actual;
+  // within dysk reservation
+  if (CONN_DYSK_RESERVED > pool->inflight) return 1;
+
+  if (AZ_MAX_TOTAL_CONNECTIONS <= atomic_read(&az_total_connections)) return 0;
+
+  return (ACCOUNT_MAX_CONNECTIONS > atomic_read(&pool->endpoint->account->connections)) ? 1 : 0;
 }
 
 // Put a connection back to pool
 void connection_pool_put(connection_pool *pool, connection **c, put_connection_reason reason)
 {
+  az_endpoint *ep     = pool->endpoint;
+  az_account *account = pool->azstate->account;
+  int lane            = (*c)->lane;
+  int inflight;
+
+  // put it back in shared queue, if queue is full close it
+  if (connection_ok == reason) {
+    (*c)->idle_since = jiffies;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+    // idle connections are shared, next dysk may not be polled
+    (*c)->sockt->sk->sk_ll_usec = (*c)->ll_usec_default;
+#endif
+  }
+
+  if (connection_ok == reason &&
+      0 == kfifo_in_spinlocked(&ep->idle, c, sizeof(connection *), &ep->lock))
+    reason = connection_failed;
+
   if (connection_failed == reason) {
     // This connection has failed tear it down and don't enqueue it
     connection_teardown(*c);
-    *c = NULL;
-    pool->count--;
-  } else {
-    // put it back in queue
-    kfifo_in(&pool->connection_queue, c, sizeof(connection *));
+    endpoint_connection_closed(ep);
   }
+
+  *c = NULL;
+  // request is off the wire
+  spin_lock(&pool->lock);
+  pool->lane_inflight[lane]--;
+  inflight = --pool->inflight;
+  spin_unlock(&pool->lock);
+  atomic_dec(&account->inflight);
+
+  if (0 == inflight) atomic_dec(&account->active);
+}
+
+// accounts for a connection leaving the pool
+static void connection_pool_checkout(connection_pool *pool, connection *c, int lane)
+{
+  az_account *account = pool->azstate->account;
+  int inflight;
+  c->lane = lane;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+  // sockets of polled dysks busy poll the device on receive
+  if (0 != pool->azstate->d->def->poll_us) c->sockt->sk->sk_ll_usec = pool->azstate->d->def->poll_us;
+#endif
+  spin_lock(&pool->lock);
+  pool->lane_inflight[lane]++;
+  inflight = ++pool->inflight;
+
+  if (inflight > pool->peak) pool->peak = inflight;
+
+  spin_unlock(&pool->lock);
+
+  if (1 == inflight) atomic_inc(&account->active);
+
+  atomic_inc(&account->inflight);
+}
+
+void az_connection_stats(dysk *d, unsigned int *live, unsigned int *peak)
+{
+  connection_pool *pool = ((az_state *) d->xfer_state)->pool;
+  spin_lock(&pool->lock);
+  *live = pool->inflight;
+  *peak = pool->peak;
+  spin_unlock(&pool->lock);
 }
 
 //gets a connection from queue or NULL if all busy
-int connection_pool_get(connection_pool *pool, connection **c)
+// new connections are only created if may_create (connecting blocks)
+int connection_pool_get(connection_pool *pool, int lane, int may_create, connection **c)
 {
   int success   = -ENOMEM;
+  az_endpoint *ep     = pool->endpoint;
+  az_account *account = pool->azstate->account;
 
-  if (0 <  connection_pool_count(pool)) { // we have connection in pool
-#if NEW_KERNEL
-    kfifo_out(&pool->connection_queue, c, sizeof(connection *));
-#else
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-    //https://lkml.org/lkml/2010/10/20/397
-    kfifo_out(&pool->connection_queue, c, sizeof(connection *));
-#pragma GCC diagnostic pop
-#endif
+  // account is at capacity or this dysk is above its fair share
+  if (0 == az_account_may_dispatch(account, pool)) return -EAGAIN;
+
+  // lane is using its share
+  if (0 == connection_lane_may_dispatch(pool, lane)) return -EAGAIN;
+
+  // are at max?
+  if (MAX_CONNECTIONS <= pool->inflight) goto failed;
+
+  // idle socket left by any dysk on this endpoint
+  while (sizeof(connection *) == kfifo_out_spinlocked(&ep->idle, c, sizeof(connection *), &ep->lock)) {
+    if (0 == connection_is_alive(*c)) {
+      connection_teardown(*c);
+      *c = NULL;
+      endpoint_connection_closed(ep);
+      continue;
+    }
+
+    connection_pool_checkout(pool, *c, lane);
     return 0;
   }
 
-  // are at max?
-  if (MAX_CONNECTIONS <= pool->count) goto failed;
+  // are we allowed to open more
+  if (0 == may_create || 0 == connection_may_connect(pool)) return -EAGAIN;
 
   // Create new
   if (0 != (success = connection_create(pool, c))) goto failed;
 
-  pool->count++;
+  endpoint_connection_opened(ep);
+  connection_pool_checkout(pool, *c, lane);
   return success;
 failed:
   return success;
 }
 
+// Closes sockets that have been idle for too long or are dead
+static void az_reap_idle_connections(struct work_struct *work)
+{
+  az_endpoint *ep;
+  connection *c       = NULL;
+  unsigned long limit = idle_timeout_secs * HZ;
+  unsigned int idle;
+  unsigned int i;
+  mutex_lock(&az_endpoints_lock);
+  list_for_each_entry(ep, &az_endpoints, list) {
+    idle = kfifo_len(&ep->idle) / sizeof(connection *);
+
+    // visit each idle socket once, whatever is kept goes back to the tail
+    for (i = 0; i < idle; i++) {
+      if (sizeof(connection *) != kfifo_out_spinlocked(&ep->idle, &c, sizeof(connection *), &ep->lock)) break;
+
+      if ((0 != limit && time_after(jiffies, c->idle_since + limit)) ||
+          0 == connection_is_alive(c) ||
+          0 == kfifo_in_spinlocked(&ep->idle, &c, sizeof(connection *), &ep->lock)) {
+        connection_teardown(c);
+        endpoint_connection_closed(ep);
+      }
+
+      c = NULL;
+    }
+  }
+  mutex_unlock(&az_endpoints_lock);
+  schedule_delayed_work(&az_reaper, AZ_REAPER_INTERVAL);
+}
+
 // Creates a pool
 static int connection_pool_init(connection_pool *pool)
 {
-  char *ip = pool->azstate->d->def->ip;
-  int port = 80;
-  int success = -ENOMEM;
-  struct sockaddr_in *server = NULL;
-  // Allocate address for all sockets
-  server =  kmalloc(sizeof(struct sockaddr_in), GFP_KERNEL);
-  if (!server) goto fail;
-
-  memset(server, 0, sizeof(struct sockaddr_in));
-  server->sin_family      = AF_INET;
-  server->sin_addr.s_addr = inet_addr(ip);
-  server->sin_port        = htons(port);
-
-  if (0 != (success = kfifo_alloc(&pool->connection_queue, sizeof(connection *) * MAX_CONNECTIONS, GFP_KERNEL))) {
-    printk(KERN_INFO  "dysk failed to create connection pool with error %d", success);
-    goto fail;
-  }
+  spin_lock_init(&pool->lock);
+  // existing endpoints come with idle sockets
+  pool->endpoint = az_endpoint_get(pool->azstate->d);
 
-  pool->server = server;
-  return success;
-fail:
-  if (server) kfree(server);
+  if (!pool->endpoint) return -ENOMEM;
 
-  return success;
+  return 0;
 }
 
 // Destroy a pool
 static void connection_pool_teardown(connection_pool *pool)
 {
-  connection *c = NULL;
-
-  // Close and destroy all the connections
-  while (0 < connection_pool_count(pool)) {
-#if NEW_KERNEL
-    kfifo_out(&pool->connection_queue, &c, sizeof(connection *));
-#else
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-    //https://lkml.org/lkml/2010/10/20/397
-    kfifo_out(&pool->connection_queue, &c, sizeof(connection *));
-#pragma GCC diagnostic pop
-#endif
-    connection_teardown(c);
-    //kfree(c);
-    c = NULL;
-  }
-
-  if (pool->server) kfree(pool->server); // free server
-
-  kfifo_free(&pool->connection_queue); // free the queue
+  // all connections used by this dysk are back on endpoint
+  az_endpoint_put(pool->endpoint);
+  pool->endpoint = NULL;
 }
 
 // ---------------------------
@@ -460,6 +1002,198 @@ static int process_response(char *response, size_t response_length, http_respons
   return http_response_completed(res, response);
 }
 
+// copies value of header (name includes ':') out of response headers
+static void response_header(char *response, size_t header_length, const char *name, char *value, size_t value_length)
+{
+  char *at = strnstr(response, name, header_length);
+  size_t len = 0;
+  value[0] = '\0';
+
+  if (!at) return;
+
+  at += strlen(name);
+
+  while (' ' == *at) at++;
+
+  while (len < value_length - 1 && '\r' != at[len] && '\0' != at[len]) len++;
+
+  memcpy(value, at, len);
+  value[len] = '\0';
+}
+
+// keeps request if it is one of the slowest completed by this dysk
+static void record_slow_request(__resstate *resstate)
+{
+  az_state *azstate = resstate->azstate;
+  struct az_slow_req *slot = NULL;
+  u64 now   = ktime_get_ns();
+  u64 total = now - resstate->start_ns;
+  int i;
+  spin_lock(&azstate->slow_lock);
+
+  if (AZ_SLOWEST_N > azstate->slow_count) {
+    slot = &azstate->slowest[azstate->slow_count++];
+  } else {
+    // replace the fastest of the slowest, if this one is slower
+    for (i = 0; i < AZ_SLOWEST_N; i++)
+      if (!slot || azstate->slowest[i].total_ns < slot->total_ns) slot = &azstate->slowest[i];
+
+    if (slot->total_ns >= total) slot = NULL;
+  }
+
+  if (slot) {
+    memcpy(slot->client_request_id, resstate->client_request_id, REQUEST_ID_LENGTH);
+    response_header(resstate->response_buffer, resstate->httpresponse->body - resstate->response_buffer,
+                    "x-ms-request-id:", slot->server_request_id, REQUEST_ID_LENGTH);
+    slot->sector       = blk_rq_pos(resstate->req);
+    slot->bytes        = blk_rq_bytes(resstate->req);
+    slot->dir          = rq_data_dir(resstate->req);
+    slot->attempt      = resstate->attempt;
+    slot->status       = resstate->httpresponse->status_code;
+    slot->completed_on = ktime_get_real_seconds();
+    slot->total_ns     = total;
+    slot->send_ns      = resstate->sent_ns - resstate->start_ns;
+    slot->wait_ns      = resstate->first_byte_ns - resstate->sent_ns;
+    slot->receive_ns   = now - resstate->first_byte_ns;
+  }
+
+  spin_unlock(&azstate->slow_lock);
+}
+
+static int slowest_show(struct seq_file *m, void *unused)
+{
+  az_state *azstate = (az_state *) m->private;
+  struct az_slow_req *slow;
+  int i;
+  seq_puts(m, "client_request_id server_request_id dir sector bytes attempt status completed_on total_us send_us wait_us receive_us\n");
+  spin_lock(&azstate->slow_lock);
+
+  for (i = 0; i < azstate->slow_count; i++) {
+    slow = &azstate->slowest[i];
+    seq_printf(m, "%s %s %c %llu %u %d %d %lld %llu %llu %llu %llu\n",
+               slow->client_request_id,
+               ('\0' == slow->server_request_id[0]) ? "-" : slow->server_request_id,
+               (WRITE == slow->dir) ? 'W' : 'R',
+               (unsigned long long) slow->sector,
+               slow->bytes,
+               slow->attempt,
+               slow->status,
+               (long long) slow->completed_on,
+               div_u64(slow->total_ns, NSEC_PER_USEC),
+               div_u64(slow->send_ns, NSEC_PER_USEC),
+               div_u64(slow->wait_ns, NSEC_PER_USEC),
+               div_u64(slow->receive_ns, NSEC_PER_USEC));
+  }
+
+  spin_unlock(&azstate->slow_lock);
+  return 0;
+}
+
+static int slowest_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, slowest_show, inode->i_private);
+}
+
+static const struct file_operations slowest_fops = {
+  .owner   = THIS_MODULE,
+  .open    = slowest_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+// ---------------------------
+// Fault injection
+// ---------------------------
+// 1 if this chance of a fault kind gets the fault
+static int fault_hit(az_state *azstate, int kind, u32 every)
+{
+  if (likely(0 == every)) return 0;
+
+  if (0 != atomic_inc_return(&azstate->faults.chances[kind]) % every) return 0;
+
+  atomic_inc(&azstate->faults.injected[kind]);
+  return 1;
+}
+
+// is it time to drop a connection picked for dropping
+static int fault_drop_now(az_state *azstate, int fault_drop, size_t wire_bytes)
+{
+  return (1 == fault_drop && wire_bytes >= azstate->faults.drop_after_bytes) ? 1 : 0;
+}
+
+// injected status is always one we recover from
+static int fault_status(az_state *azstate)
+{
+  int status = (int) azstate->faults.status_code;
+  return (1 == az_is_throttle(status)) ? status : AZ_RESPONSE_ERR_THROTTLE;
+}
+
+#if NEW_KERNEL
+// hides all but short_io_bytes of a message from the socket,
+// returns bytes hidden. fault_short_io_end() gives them back
+static size_t fault_short_io(az_state *azstate, struct msghdr *msg)
+{
+  size_t left = msg_data_left(msg);
+  u32 cap     = azstate->faults.short_io_bytes;
+
+  if (likely(0 == cap) || left <= cap) return 0;
+
+  iov_iter_truncate(&msg->msg_iter, cap);
+  atomic_inc(&azstate->faults.injected[AZ_FAULT_SHORT]);
+  return left - cap;
+}
+
+static void fault_short_io_end(struct msghdr *msg, size_t hidden)
+{
+  if (0 != hidden) iov_iter_reexpand(&msg->msg_iter, msg_data_left(msg) + hidden);
+}
+#endif
+
+static int faults_show(struct seq_file *m, void *unused)
+{
+  static const char *kinds[AZ_FAULTS] = { "drop", "short_io", "status", "delay", "alloc" };
+  az_state *azstate = (az_state *) m->private;
+  int kind;
+
+  for (kind = 0; kind < AZ_FAULTS; kind++)
+    seq_printf(m, "%s %d\n", kinds[kind], atomic_read(&azstate->faults.injected[kind]));
+
+  return 0;
+}
+
+static int faults_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, faults_show, inode->i_private);
+}
+
+static const struct file_operations faults_fops = {
+  .owner   = THIS_MODULE,
+  .open    = faults_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+static void faults_init(az_state *azstate, struct dentry *parent)
+{
+  az_faults *faults = &azstate->faults;
+  struct dentry *dir = debugfs_create_dir("faults", parent);
+
+  if (IS_ERR_OR_NULL(dir)) return;
+
+  faults->dir = dir;
+  debugfs_create_u32("drop_every", 0600, dir, &faults->drop_every);
+  debugfs_create_u32("drop_after_bytes", 0600, dir, &faults->drop_after_bytes);
+  debugfs_create_u32("short_io_bytes", 0600, dir, &faults->short_io_bytes);
+  debugfs_create_u32("status_every", 0600, dir, &faults->status_every);
+  debugfs_create_u32("status_code", 0600, dir, &faults->status_code);
+  debugfs_create_u32("delay_every", 0600, dir, &faults->delay_every);
+  debugfs_create_u32("delay_ms", 0600, dir, &faults->delay_ms);
+  debugfs_create_u32("alloc_fail_every", 0600, dir, &faults->alloc_fail_every);
+  debugfs_create_file("injected", 0444, dir, azstate, &faults_fops);
+}
+
 // Makes request header
 int make_header(__reqstate *reqstate, char *header_buffer, size_t header_buffer_len)
 {
@@ -470,19 +1204,24 @@ int make_header(__reqstate *reqstate, char *header_buffer, size_t header_buffer_
   dysk *d               = NULL;
   size_t range_start    = 0;
   size_t range_end      = 0;
+  size_t range_bytes    = 0;
   int res = -ENOMEM;
   req = reqstate->req;
   dir = rq_data_dir(req);
   d = reqstate->azstate->d;
   // Ranges
-  range_start = ((u64) blk_rq_pos(req) << 9);
-  range_end   = (range_start + blk_rq_bytes(req) - 1);
+  span_range(reqstate->span, reqstate->span_count, &range_start, &range_bytes);
+  range_end   = (range_start + range_bytes - 1);
   // date
-  date = kmalloc(DATE_LENGTH, GFP_KERNEL);
+  date = kmalloc(DATE_LENGTH, GFP_NOIO);
 
   if (!date) goto done;
 
   utc_RFC1123_date(date, DATE_LENGTH);
+  // every attempt gets its own id: dysk-<slot>-<sequence>
+  snprintf(reqstate->client_request_id, REQUEST_ID_LENGTH, "dysk-%u-%llu",
+           d->slot, (unsigned long long) atomic64_inc_return(&reqstate->azstate->request_seq));
+
   if (READ == dir) {
     if(1 == d->def->readOnly){
     // readonly disks we ignore lease
@@ -494,7 +1233,7 @@ int make_header(__reqstate *reqstate, char *header_buffer, size_t header_buffer_
             range_start,
             range_end,
             date,
-            d->def->accountName);
+            reqstate->client_request_id);
     }else{
     //PATH/Sas/HOST/ContentLength/Range-Start/Range-End/Date/AccountName/AuthToken
     sprintf(header_buffer, get_request_head,
@@ -506,7 +1245,7 @@ int make_header(__reqstate *reqstate, char *header_buffer, size_t header_buffer_
             range_start,
             range_end,
             date,
-            d->def->accountName);
+            reqstate->client_request_id);
     }
   } else {
     //PATH/Sas/HOST/ContentLength/Range-Start/Range-End/Date/AccountName/AuthToken
@@ -519,7 +1258,7 @@ int make_header(__reqstate *reqstate, char *header_buffer, size_t header_buffer_
             range_start,
             range_end,
             date,
-            d->def->accountName);
+            reqstate->client_request_id);
   }
 
   res = 0;
@@ -537,11 +1276,12 @@ void __clean_receive_az_response(w_task *this_task, task_clean_reason clean_reas
   int free_all = 0;
   __resstate *resstate  = (__resstate *) this_task->state;
 
-  if (resstate->c) connection_pool_put(resstate->azstate->pool, &resstate->c, connection_ok);
+  // a response may still be on its way on a connection given up on
+  if (resstate->c) connection_pool_put(resstate->azstate->pool, &resstate->c, (clean_done == clean_reason) ? connection_ok : connection_failed);
 
   resstate->c = NULL;
 
-  if (clean_done) {
+  if (clean_done == clean_reason) {
     free_all = 1;
 
     if (0 == resstate->try_new_request) {
@@ -550,7 +1290,7 @@ void __clean_receive_az_response(w_task *this_task, task_clean_reason clean_reas
         resstate->reqstate = NULL;
       }
 
-      io_end_request(this_task->d, resstate->req, 0);
+      io_end_span(this_task, resstate->span, resstate->span_count, resstate->start_ns, 0);
     } else {
       //DEBUG
       //printk(KERN_INFO "RECV TRY NEW REQUEST");
@@ -563,7 +1303,7 @@ void __clean_receive_az_response(w_task *this_task, task_clean_reason clean_reas
       resstate->reqstate = NULL;
     }
 
-    io_end_request(this_task->d, resstate->req, (clean_reason == clean_timeout) ? -EAGAIN  : -EIO);
+    io_end_span(this_task, resstate->span, resstate->span_count, resstate->start_ns, (clean_reason == clean_timeout) ? -EAGAIN  : -EIO);
     free_all = 1;
   }
 
@@ -593,17 +1333,23 @@ task_result __receive_az_response(w_task *this_task)
   struct request *req   = NULL; // ref'ed from state
   connection *c         = NULL; // ref'ed from  state
   connection_pool *pool = NULL; // ref'ed out of state -- module state
+  az_state *azstate     = NULL; // ref'ed out of state -- module state
   // Calculated
   size_t range_start    = 0;
-  size_t range_end      = 0;
+  size_t range_bytes    = 0;
   size_t response_size  = 0;
   int success           = 0;
   int dir               = 0;
+  int i;
   task_result res = done;
   mm_segment_t oldfs;
+#if NEW_KERNEL
+  size_t hidden         = 0; // held back from socket (fault)
+#endif
   // Extract state
   resstate = (__resstate *) this_task->state;
-  pool     = resstate->azstate->pool;
+  azstate  = resstate->azstate;
+  pool     = azstate->pool;
   req      = resstate->req;
   c        = resstate->c;
 
@@ -611,13 +1357,14 @@ task_result __receive_az_response(w_task *this_task)
   if (1 == resstate->try_new_request) goto retry_new_request;
 
   // Ranges
-  range_start   = ((u64) blk_rq_pos(req) << 9);
-  range_end     = range_start + blk_rq_bytes(req) - 1;
-  response_size = (READ == rq_data_dir(req)) ?  blk_rq_bytes(req) + RESPONSE_HEADER_LENGTH : RESPONSE_HEADER_LENGTH;
+  span_range(resstate->span, resstate->span_count, &range_start, &range_bytes);
+  response_size = (READ == rq_data_dir(req)) ?  range_bytes + RESPONSE_HEADER_LENGTH : RESPONSE_HEADER_LENGTH;
 
   // allocate response buffer
   if (!resstate->response_buffer) {
-    resstate->response_buffer = (char *) kmalloc(response_size, GFP_KERNEL);
+    if (1 == fault_hit(azstate, AZ_FAULT_ALLOC, azstate->faults.alloc_fail_every)) return retry_later;
+
+    resstate->response_buffer = (char *) kmalloc(response_size, GFP_NOIO);
 
     if (!resstate->response_buffer) return retry_later;
 
@@ -627,7 +1374,7 @@ task_result __receive_az_response(w_task *this_task)
   // allocate http response object
   if (!resstate->httpresponse) {
     // allocate http response buffers
-    resstate->httpresponse = kmalloc(sizeof(http_response), GFP_KERNEL);
+    resstate->httpresponse = kmalloc(sizeof(http_response), GFP_NOIO);
 
     if (!resstate->httpresponse) return retry_later;
 
@@ -646,13 +1393,13 @@ task_result __receive_az_response(w_task *this_task)
 
   // recieve message
   if (!resstate->msg) {
-    resstate->msg = kmalloc(sizeof(struct msghdr), GFP_KERNEL);
+    resstate->msg = kmalloc(sizeof(struct msghdr), GFP_NOIO);
 
     if (!resstate->msg) return retry_later;
 
     memset(resstate->msg, 0, sizeof(struct msghdr));
-    resstate->msg->msg_name       = NULL; //pool->server;
-    resstate->msg->msg_namelen    = 0;    //sizeof(pool->server);
+    resstate->msg->msg_name       = NULL; //&pool->endpoint->server;
+    resstate->msg->msg_namelen    = 0;    //sizeof(pool->endpoint->server);
     resstate->msg->msg_control    = NULL;
     resstate->msg->msg_controllen = 0;
     resstate->msg->msg_flags      = 0;
@@ -660,7 +1407,7 @@ task_result __receive_az_response(w_task *this_task)
 
   // iterator
   if (!resstate->iov) {
-    resstate->iov = kmalloc(sizeof(struct iovec), GFP_KERNEL);
+    resstate->iov = kmalloc(sizeof(struct iovec), GFP_NOIO);
 
     if (!resstate->iov) return retry_later;
 
@@ -678,10 +1425,19 @@ task_result __receive_az_response(w_task *this_task)
   if (0 == http_response_completed(resstate->httpresponse, resstate->response_buffer)) {
     // receive ite
     while (0 == http_response_completed(resstate->httpresponse, resstate->response_buffer)) {
+      if (1 == fault_drop_now(resstate->azstate, resstate->fault_drop, resstate->wire_bytes)) {
+        connection_pool_put(pool, &c, connection_failed);
+        dysk_stat_inc(this_task->d, conn_failures);
+        resstate->c = NULL;
+        goto retry_new_request;
+      }
+
       oldfs = get_fs();
       set_fs(KERNEL_DS);
 #if NEW_KERNEL
+      hidden  = fault_short_io(resstate->azstate, resstate->msg);
       success = sock_recvmsg(c->sockt, resstate->msg, MSG_DONTWAIT);
+      fault_short_io_end(resstate->msg, hidden);
 #else
       // forward message pointer
       resstate->iov->iov_base = (resstate->response_buffer + resstate->httpresponse->bytes_received);
@@ -697,19 +1453,45 @@ task_result __receive_az_response(w_task *this_task)
           //DEBUG
           //printk(KERN_INFO "RCV CONNECTION CLOSE!");
           connection_pool_put(pool, &c, connection_failed);
+          dysk_stat_inc(this_task->d, conn_failures);
           resstate->c = NULL;
           goto retry_new_request;
         }
       }
 
+      if (0 == resstate->httpresponse->bytes_received) {
+        resstate->first_byte_ns = ktime_get_ns();
+        trace_dysk_rq_first_byte(this_task->d, req, resstate->attempt);
+      }
+
+      resstate->wire_bytes += success;
+
       if (1 == process_response(resstate->response_buffer, strlen(resstate->response_buffer), resstate->httpresponse, success))
         break;
+#if NEW_KERNEL
+      // short receive, pick up the rest on next pass
+      if (0 != hidden) return retry_later;
+#endif
     }
   }
 
   if (1 == http_response_completed(resstate->httpresponse, resstate->response_buffer)) {
+    // hold the response, long enough holds run into request time out
+    if (0 == resstate->fault_delayed && 1 == fault_hit(azstate, AZ_FAULT_DELAY, azstate->faults.delay_every)) {
+      resstate->fault_delayed = 1;
+      resstate->fault_until   = jiffies + msecs_to_jiffies(azstate->faults.delay_ms);
+    }
+
+    if (1 == resstate->fault_delayed && time_before(jiffies, resstate->fault_until)) return retry_later;
+
+    if (1 == fault_hit(azstate, AZ_FAULT_STATUS, azstate->faults.status_every))
+      resstate->httpresponse->status_code = fault_status(azstate);
+
+    trace_dysk_rq_response(this_task->d, req, resstate->attempt, resstate->httpresponse->status_code);
+
     if (1 == az_is_catastrophe(resstate->httpresponse->status_code)) {
       printk(KERN_ERR "dysk:[%s] entered catastrophe mode because http response was:%d-%s", this_task->d->def->deviceName, resstate->httpresponse->status_code, resstate->httpresponse->status);
+      trace_dysk_rq_decision(this_task->d, req, resstate->attempt, "catastrophe");
       return catastrophe;
     }
 
@@ -717,6 +1499,7 @@ task_result __receive_az_response(w_task *this_task)
 
     if (1 != az_is_done(resstate->httpresponse->status_code)) {
       printk(KERN_ERR "** dysk az module got an expected status code %d and will go into catastrophe mode for [%s] - response is:%s", resstate->httpresponse->status_code, this_task->d->def->deviceName, resstate->httpresponse->body);
+      trace_dysk_rq_decision(this_task->d, req, resstate->attempt, "catastrophe");
       return catastrophe;
     }
 
@@ -725,19 +1508,21 @@ task_result __receive_az_response(w_task *this_task)
     // No reentrancy handling needed for this part
     dir = rq_data_dir(req);
 
-    if (READ == dir) {
+    // each request of the span gets its slice, gaps are dropped
+    for (i = 0; READ == dir && i < resstate->span_count; i++) {
       // Response iterator
       struct req_iterator iter;
       struct bio_vec bvec;
-      size_t mark = 0;
+      struct request *span_req = resstate->span[i];
+      size_t mark = ((u64) blk_rq_pos(span_req) << 9) - range_start;
       void *target_buffer;
       size_t len;
       //write: Response in request bio
 #if NEW_KERNEL
-      rq_for_each_segment(bvec, req, iter) {
+      rq_for_each_segment(bvec, span_req, iter) {
 #else
       struct bio_vec *_bvec;
-      rq_for_each_segment(_bvec, req, iter) {
+      rq_for_each_segment(_bvec, span_req, iter) {
       memcpy(&bvec, _bvec, sizeof(struct bio_vec));
 #endif
         len =  bvec.bv_len;
@@ -748,12 +1533,14 @@ task_result __receive_az_response(w_task *this_task)
       }
     }
 
+    record_slow_request(resstate);
     return done;
   }
 
   printk(KERN_ERR "** dysk az module got unexpected response and will fail :%s", resstate->response_buffer);
   /* we shouldn't be here */
 retry_throttle:
+  az_account_throttle(resstate->azstate->account);
   res = throttle_dysk;
 retry_new_request:
   //set that we are trying with new request
@@ -761,8 +1548,15 @@ retry_new_request:
   //create new request
   resstate->reqstate->req     = req;
   resstate->reqstate->azstate = resstate->azstate;
-
-  if (0 != queue_w_task(this_task, this_task->d, &__send_az_req, &__clean_send_az_req, normal, resstate->reqstate))
+  memcpy(resstate->reqstate->span, resstate->span, sizeof(resstate->span));
+  resstate->reqstate->span_count = resstate->span_count;
+  resstate->reqstate->attempt    = resstate->attempt + 1;
+  resstate->reqstate->start_ns   = resstate->start_ns;
+  dysk_stat_inc(this_task->d, resends);
+  trace_dysk_rq_decision(this_task->d, req, resstate->attempt, (throttle_dysk == res) ? "throttle" : "resend");
+  trace_dysk_rq_queue(this_task->d, req, resstate->reqstate->attempt);
+
+  if (0 != queue_w_task(this_task, this_task->d, NULL, &__send_az_req, &__clean_send_az_req, normal, resstate->reqstate))
     return retry_now;
 
   return res; // we have failed to get response now, but will try with new request
@@ -774,7 +1568,7 @@ void __clean_send_az_req(w_task *this_task, task_clean_reason clean_reason)
   int free_all = 0;
   __reqstate *reqstate  = (__reqstate *) this_task->state;
 
-  if (clean_done) {
+  if (clean_done == clean_reason) {
     if (0 == reqstate->try_new_request) {
       free_all = 1;
     } else {
@@ -796,10 +1590,11 @@ void __clean_send_az_req(w_task *this_task, task_clean_reason clean_reason)
       reqstate->resstate = NULL;
     }
 
-    if (reqstate->c) connection_pool_put(reqstate->azstate->pool, &reqstate->c, connection_ok);
+    // request may be half sent on it
+    if (reqstate->c) connection_pool_put(reqstate->azstate->pool, &reqstate->c, connection_failed);
 
     reqstate->c = NULL;
-    io_end_request(this_task->d, reqstate->req, (clean_reason == clean_timeout) ? -EAGAIN  : -EIO);
+    io_end_span(this_task, reqstate->span, reqstate->span_count, reqstate->start_ns, (clean_reason == clean_timeout) ? -EAGAIN  : -EIO);
     free_all = 1;
   }
 
@@ -835,19 +1630,17 @@ task_result __send_az_req(w_task *this_task)
   struct request *req   = NULL; // ref'ed out of task state
   connection_pool *pool = NULL; // ref'ed out of task state (xfer  state)
   __reqstate *reqstate  = NULL; // ref'ed out of task state
-  size_t range_start    = 0;
-  size_t range_end      = 0;
   int dir               = 0;
   int success           = 0;
   mm_segment_t oldfs;
+#if NEW_KERNEL
+  size_t hidden         = 0; // held back from socket (fault)
+#endif
   // Extract state - created by created or task
   reqstate = (__reqstate *) this_task->state;
   pool     = reqstate->azstate->pool;
   req      = reqstate->req;
   dir      = rq_data_dir(req);
-  // Calculate Ranges
-  range_start = ((u64) blk_rq_pos(req) << 9);
-  range_end   = (range_start +  blk_rq_bytes(req) - 1);
 
   if (1 == reqstate->try_new_request) goto retry_new_request;
 
@@ -855,55 +1648,74 @@ task_result __send_az_req(w_task *this_task)
 
   // upstream header
   if (!reqstate->header_buffer) {
+    if (1 == fault_hit(reqstate->azstate, AZ_FAULT_ALLOC, reqstate->azstate->faults.alloc_fail_every))
+      return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
+
     //allocate
-    reqstate->header_buffer = kmalloc(HEADER_LENGTH, GFP_KERNEL);
+    reqstate->header_buffer = kmalloc(HEADER_LENGTH, GFP_NOIO);
 
-    if (!reqstate->header_buffer) return retry_now;
+    if (!reqstate->header_buffer) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
     memset(reqstate->header_buffer, 0, HEADER_LENGTH);
     //create or retry
     success = make_header(reqstate, reqstate->header_buffer, HEADER_LENGTH);
 
-    if (0 != success) return retry_now;
+    if (0 != success) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
   }
 
   if (!reqstate->resstate) {
     // response state object
     reqstate->resstate = kmem_cache_alloc(az_slab, GFP_NOIO);
 
-    if (!reqstate->resstate) return retry_now;
+    if (!reqstate->resstate) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
     memset(reqstate->resstate, 0, sizeof(__resstate));
   }
 
   // connection
   if (!reqstate->c) {
-    if (0 != (success = connection_pool_get(pool, &reqstate->c))) {
+    // a sibling dysk got throttled, hold off until account recovers
+    if (1 == az_account_throttled(reqstate->azstate->account))
+      return w_task_retry_after(this_task, az_account_throttle_left(reqstate->azstate->account));
+
+    // inline submission only takes idle connections, worker creates new ones
+    if (0 != (success = connection_pool_get(pool, connection_lane(reqstate->span, reqstate->span_count), !this_task->inline_exec, &reqstate->c))) {
       // signal catastrophe if needed
-      if (success == ERR_FAILED_CONNECTION)
+      if (success == ERR_FAILED_CONNECTION) {
+        dysk_stat_inc(this_task->d, conn_failures);
+        trace_dysk_rq_decision(this_task->d, req, reqstate->attempt, "catastrophe");
         return  catastrophe;
+      }
+
+      // inline: worker may create one, hand off right away
+      if (1 == this_task->inline_exec) return retry_later;
 
-      return retry_later;
+      // pool (or account) is at its limit, don't spin the send stage on it
+      return w_task_retry_after(this_task, AZ_CONN_RETRY_DELAY);
     }
+
+    trace_dysk_rq_conn(this_task->d, req, reqstate->attempt, 0 == reqstate->c->idle_since);
+    reqstate->fault_drop = fault_hit(reqstate->azstate, AZ_FAULT_DROP, reqstate->azstate->faults.drop_every);
+    reqstate->wire_bytes = 0;
   }
 
   if (!reqstate->header_msg) {
-    reqstate->header_msg = kmalloc(sizeof(struct msghdr), GFP_KERNEL);
+    reqstate->header_msg = kmalloc(sizeof(struct msghdr), GFP_NOIO);
 
-    if (!reqstate->header_msg) return retry_now;
+    if (!reqstate->header_msg) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
     memset(reqstate->header_msg, 0, sizeof(struct msghdr));
     reqstate->header_msg->msg_control    = NULL;
     reqstate->header_msg->msg_controllen = 0;
-    reqstate->header_msg->msg_name       = pool->server;
+    reqstate->header_msg->msg_name       = &pool->endpoint->server;
     reqstate->header_msg->msg_namelen    = sizeof(struct sockaddr_in);
     reqstate->header_msg->msg_flags      = MSG_DONTWAIT;
   }
 
   if (!reqstate->header_iov) {
-    reqstate->header_iov = kmalloc(sizeof(struct iovec), GFP_KERNEL);
+    reqstate->header_iov = kmalloc(sizeof(struct iovec), GFP_NOIO);
 
-    if (!reqstate->header_iov) return retry_now;
+    if (!reqstate->header_iov) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
     memset(reqstate->header_iov, 0, sizeof(struct iovec));
     reqstate->header_iov->iov_base = reqstate->header_buffer;
@@ -926,10 +1738,14 @@ task_result __send_az_req(w_task *this_task)
     size_t remaining = strlen(reqstate->header_buffer);
     while(remaining){
 #endif
+      if (1 == fault_drop_now(reqstate->azstate, reqstate->fault_drop, reqstate->wire_bytes)) goto fault_drop_connection;
+
       oldfs = get_fs();
       set_fs(KERNEL_DS);
 #if NEW_KERNEL
+      hidden  = fault_short_io(reqstate->azstate, reqstate->header_msg);
       success = sock_sendmsg(reqstate->c->sockt, reqstate->header_msg);
+      fault_short_io_end(reqstate->header_msg, hidden);
 #else
       //forward buffer pointer
       reqstate->header_iov->iov_base = reqstate->header_buffer + (strlen(reqstate->header_buffer) - remaining);
@@ -943,14 +1759,21 @@ task_result __send_az_req(w_task *this_task)
 
         // drop connection here
         connection_pool_put(pool, &reqstate->c, connection_failed);
+        dysk_stat_inc(this_task->d, conn_failures);
         reqstate->c = NULL;
         goto retry_new_request;
       }
-#if !(NEW_KERNEL)
+
+      reqstate->wire_bytes += success;
+#if NEW_KERNEL
+      // short send, pick up the rest on next pass
+      if (0 != hidden) return retry_later;
+#else
     remaining -= success;
 #endif
     }
     reqstate->header_sent = 1;
+    trace_dysk_rq_header_sent(this_task->d, req, reqstate->attempt);
   }
 
   if (WRITE == dir) {
@@ -963,9 +1786,9 @@ task_result __send_az_req(w_task *this_task)
       size_t mark = 0;
       void *target_buffer;
       size_t len;
-      reqstate->body_buffer = kmalloc(blk_rq_bytes(req), GFP_KERNEL);
+      reqstate->body_buffer = kmalloc(blk_rq_bytes(req), GFP_NOIO);
 
-      if (!reqstate->body_buffer) return retry_now;
+      if (!reqstate->body_buffer) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
       memset(reqstate->body_buffer, 0, blk_rq_bytes(req));
       /* While i love to do scatter gather here but tracking
@@ -991,22 +1814,22 @@ task_result __send_az_req(w_task *this_task)
     }
 
     if (!reqstate->body_msg) {
-      reqstate->body_msg = kmalloc(sizeof(struct msghdr), GFP_KERNEL);
+      reqstate->body_msg = kmalloc(sizeof(struct msghdr), GFP_NOIO);
 
-      if (!reqstate->body_msg) return retry_now;
+      if (!reqstate->body_msg) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
       memset(reqstate->body_msg, 0, sizeof(struct msghdr));
       reqstate->body_msg->msg_control     = NULL;
       reqstate->body_msg->msg_controllen  = 0;
-      reqstate->body_msg->msg_name        = pool->server;
+      reqstate->body_msg->msg_name        = &pool->endpoint->server;
       reqstate->body_msg->msg_namelen     = sizeof(struct sockaddr_in);
       reqstate->body_msg->msg_flags       = MSG_DONTWAIT;
     }
 
     if (!reqstate->body_iov) {
-      reqstate->body_iov = kmalloc(sizeof(struct iovec), GFP_KERNEL);
+      reqstate->body_iov = kmalloc(sizeof(struct iovec), GFP_NOIO);
 
-      if (!reqstate->body_iov) return retry_now;
+      if (!reqstate->body_iov) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
       memset(reqstate->body_iov, 0, sizeof(struct iovec));
       reqstate->body_iov->iov_base = reqstate->body_buffer;
@@ -1030,10 +1853,14 @@ task_result __send_az_req(w_task *this_task)
 
     while (remaining) {
 #endif
+      if (1 == fault_drop_now(reqstate->azstate, reqstate->fault_drop, reqstate->wire_bytes)) goto fault_drop_connection;
+
       oldfs = get_fs();
       set_fs(KERNEL_DS);
 #if NEW_KERNEL
+      hidden  = fault_short_io(reqstate->azstate, reqstate->body_msg);
       success = sock_sendmsg(reqstate->c->sockt, reqstate->body_msg);
+      fault_short_io_end(reqstate->body_msg, hidden);
 #else
       //forward message body pointer
       reqstate->body_iov->iov_base = reqstate->body_buffer + (blk_rq_bytes(req) - remaining);
@@ -1049,15 +1876,21 @@ task_result __send_az_req(w_task *this_task)
         //printk("FAILED TO SEND PUT BODY MESSAGE: %d", success);
         //drop connection here
         connection_pool_put(pool, &reqstate->c, connection_failed);
+        dysk_stat_inc(this_task->d, conn_failures);
         reqstate->c = NULL;
         goto retry_new_request;
       }
-#if !(NEW_KERNEL)
+
+      reqstate->wire_bytes += success;
+#if NEW_KERNEL
+      if (0 != hidden) return retry_later;
+#else
       remaining -= success;
 #endif
     }
 
     reqstate->body_sent = 1;
+    trace_dysk_rq_body_sent(this_task->d, req, reqstate->attempt);
   } // if WRITE == dir
 
   reqstate->body_sent = 1;
@@ -1068,17 +1901,32 @@ message_sent:
   reqstate->resstate->azstate = reqstate->azstate;
   reqstate->resstate->req     = reqstate->req;
   reqstate->resstate->c       = reqstate->c;
-  // Queue the receive part, fathering it with this task.
-  success = queue_w_task(this_task, this_task->d, &__receive_az_response, __clean_receive_az_response,  no_throttle, reqstate->resstate);
-
-  if (0 != success) return retry_now;
+  memcpy(reqstate->resstate->span, reqstate->span, sizeof(reqstate->span));
+  reqstate->resstate->span_count = reqstate->span_count;
+  reqstate->resstate->attempt    = reqstate->attempt;
+  reqstate->resstate->start_ns   = reqstate->start_ns;
+  reqstate->resstate->sent_ns    = ktime_get_ns();
+  reqstate->resstate->fault_drop = reqstate->fault_drop;
+  reqstate->resstate->wire_bytes = reqstate->wire_bytes;
+  memcpy(reqstate->resstate->client_request_id, reqstate->client_request_id, REQUEST_ID_LENGTH);
+  // Queue the receive part on receive stage, fathering it with this task.
+  success = queue_w_rx_task(this_task, &__receive_az_response, __clean_receive_az_response, reqstate->resstate);
+
+  if (0 != success) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
   return  done;
+fault_drop_connection: // injected, fails the connection the way a reset would
+  connection_pool_put(pool, &reqstate->c, connection_failed);
+  dysk_stat_inc(this_task->d, conn_failures);
+  reqstate->c = NULL;
 retry_new_request: // Failed to send the complete request. retry from the top
   reqstate->try_new_request = 1;
-  success = queue_w_task(this_task, this_task->d, &__send_az_req, __clean_send_az_req, normal, reqstate);
+  trace_dysk_rq_decision(this_task->d, req, reqstate->attempt++, "resend");
+  dysk_stat_inc(this_task->d, resends);
+  trace_dysk_rq_queue(this_task->d, req, reqstate->attempt);
+  success = queue_w_task(this_task, this_task->d, NULL, &__send_az_req, __clean_send_az_req, normal, reqstate);
 
-  if (0 != success) return retry_now;
+  if (0 != success) return w_task_retry_after(this_task, AZ_NOMEM_RETRY_DELAY);
 
   return done;
 }
@@ -1086,18 +1934,30 @@ retry_new_request: // Failed to send the complete request. retry from the top
 // Main entry point for request handling
 // ---------------------------
 // places the request in queue.
-int az_do_request(dysk *d, struct request *req)
+int az_do_request(dysk *d, struct request **span, int span_count, int last)
 {
+  struct request *req  = span[0];
   int success = 0;
   __reqstate *reqstate = NULL;
-  reqstate = kmem_cache_alloc(az_slab, GFP_NOIO);
+
+  // block layer requeues it
+  if (1 == fault_hit((az_state *) d->xfer_state, AZ_FAULT_ALLOC, ((az_state *) d->xfer_state)->faults.alloc_fail_every))
+    return -ENOMEM;
+
+  // state lives on the node of the worker that serves it
+  reqstate = kmem_cache_alloc_node(az_slab, GFP_NOIO, d->worker->node);
 
   if (!reqstate) return -ENOMEM;
 
   memset(reqstate, 0, sizeof(__reqstate));
   reqstate->req     = req;
+  memcpy(reqstate->span, span, span_count * sizeof(struct request *));
+  reqstate->span_count = span_count;
   reqstate->azstate = (az_state *) d->xfer_state;
-  success = queue_w_task(NULL, d, &__send_az_req, __clean_send_az_req, normal, reqstate);
+  reqstate->start_ns = ktime_get_ns();
+  trace_dysk_rq_queue(d, req, 0);
+  // try to send it right away, worker picks it up otherwise
+  success = run_w_task(d, req, &__send_az_req, __clean_send_az_req, normal, reqstate, last);
 
   if (0 != success) {
     if (reqstate) kmem_cache_free(az_slab, reqstate);
@@ -1129,9 +1989,25 @@ int az_init_for_dysk(dysk *d)
   pool->azstate = azstate;
   azstate->d = d;
 
-  if (0 != (success = connection_pool_init(pool))) goto free_all;
+  // account governor
+  azstate->account = az_account_get(d->def->host);
+
+  if (!azstate->account) {
+    kfree(pool);
+    success = -ENOMEM;
+    goto free_all;
+  }
+
+  if (0 != (success = connection_pool_init(pool))) {
+    kfree(pool);
+    goto free_all;
+  }
 
   azstate->pool = pool;
+  atomic64_set(&azstate->request_seq, 0);
+  spin_lock_init(&azstate->slow_lock);
+  azstate->slowest_file = debugfs_create_file("slowest", 0444, d->debugfs, azstate, &slowest_fops);
+  faults_init(azstate, d->debugfs);
   return success;
 free_all:
   az_teardown_for_dysk(d);
@@ -1145,12 +2021,18 @@ void az_teardown_for_dysk(dysk *d)
 
   if (!azstate) return; // already cleaned.
 
+  debugfs_remove(azstate->slowest_file);
+  debugfs_remove_recursive(azstate->faults.dir);
+
    if (azstate->pool) {
     connection_pool_teardown(azstate->pool);
     kfree(azstate->pool);
   }
 
+  if (azstate->account) az_account_put(azstate->account);
+
   kfree(azstate);
+  d->xfer_state = NULL;
 }
 
 // ---------------------------
@@ -1165,15 +2047,26 @@ int az_init(void)
   az_slab = kmem_cache_create(AZ_SLAB_NAME,
                               entry_size,
                               0, /*no special behavior */
-                              0, /* no alignment a cache miss is ok, for now */
+                              SLAB_HWCACHE_ALIGN, /* state is shared between submitter and worker */
                               NULL /*let kernel create pages */);
 
   if (!az_slab) return -1;
 
+  schedule_delayed_work(&az_reaper, AZ_REAPER_INTERVAL);
   return 0;
 }
 
 void az_teardown(void)
 {
+  cancel_delayed_work_sync(&az_reaper);
+
   if (az_slab) kmem_cache_destroy(az_slab);
 }
+
+const dysk_xfer az_xfer = {
+  .name              = "az",
+  .init_for_dysk     = az_init_for_dysk,
+  .teardown_for_dysk = az_teardown_for_dysk,
+  .do_request        = az_do_request,
+  .connection_stats  = az_connection_stats,
+};
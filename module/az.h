@@ -18,6 +18,14 @@ void az_teardown(void);
 int az_init_for_dysk(dysk *d);
 void az_teardown_for_dysk(dysk *d);
 
-int az_do_request(dysk *d, struct request *req);
+// span: one write, or up to DYSK_SPAN_MAX reads in ascending order
+// (gaps allowed) served by a single ranged request
+int az_do_request(dysk *d, struct request **span, int span_count, int last);
+
+// connections checked out by dysk now and at most so far
+void az_connection_stats(dysk *d, unsigned int *live, unsigned int *peak);
+
+// DYSK_XFER_AZ
+extern const dysk_xfer az_xfer;
 
 #endif
@@ -10,12 +10,24 @@
 #include <linux/types.h>
 #include <linux/blkdev.h>
 #include <linux/bio.h>
+#include <linux/atomic.h>
+#include <linux/sysfs.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/delay.h>
 
 #include <linux/version.h>
 
 #include "dysk_utils.h"
 #include "dysk_bdd.h"
 #include "az.h"
+#include "mem.h"
+
+#define CREATE_TRACE_POINTS
+#include "dysk_trace.h"
 
 
 /* avoid building against older kernel */
@@ -112,13 +124,24 @@ struct class *class;
 struct device *device;
 // List of current dysks
 static dyskslist dysks;
-// worker instance used by all dysks
-dysk_worker default_worker;
+// one worker per numa node, dysks are spread across them
+static dysk_worker *workers[MAX_NUMNODES];
+// transports, indexed by DYSK_XFER_*
+static const dysk_xfer *xfers[] = {
+  [DYSK_XFER_AZ]   = &az_xfer,
+  [DYSK_XFER_NULL] = &null_xfer,
+  [DYSK_XFER_RAM]  = &ram_xfer,
+};
+
+struct dentry *dysk_debugfs;
 
 // Endpoint contants
 #define MAX_IN_OUT 2048
 #define LINE_LENGTH 32
 
+// how long to hold off the block layer queue when a dysk can't take more
+#define DYSK_QUEUE_DELAY_MS 1
+
 const char *dysk_ok = "OK\n";
 const char *dysk_err = "ERR\n";
 const char *n  = "\n";
@@ -128,6 +151,620 @@ const char *RW = "RW";
 int io_hook(dysk *d);
 int io_unhook(dysk *d);
 
+// worker serving the fewest dysks
+static dysk_worker *pick_worker(void)
+{
+  dysk_worker *picked = NULL;
+  int node;
+  for_each_online_node(node) {
+    if (!workers[node]) continue;
+
+    if (!picked || workers[node]->count_dysks < picked->count_dysks) picked = workers[node];
+  }
+  return picked;
+}
+
+// ---------------------------------
+// In-flight budget
+// ---------------------------------
+/*
+ Each dispatched request holds its data (write body or read response)
+ in kernel memory until it completes. Bytes and requests dispatched are
+ capped per dysk and module wide (0 is no cap). A dysk with nothing in
+ flight can always dispatch one request, so a cap smaller than the
+ largest request does not stall it.
+*/
+#define DYSK_BUDGET_RESPONSE_OVERHEAD 1024 // response header kept with each read
+
+static unsigned int dysk_max_inflight_mb = 64;
+module_param(dysk_max_inflight_mb, uint, 0644);
+MODULE_PARM_DESC(dysk_max_inflight_mb, "Max MB of request data in flight per dysk (0 no cap)");
+
+static unsigned int dysk_max_inflight_reqs = 64;
+module_param(dysk_max_inflight_reqs, uint, 0644);
+MODULE_PARM_DESC(dysk_max_inflight_reqs, "Max requests in flight per dysk, also sets queue depth (0 no cap)");
+
+static unsigned int max_inflight_mb = 1024;
+module_param(max_inflight_mb, uint, 0644);
+MODULE_PARM_DESC(max_inflight_mb, "Max MB of request data in flight across all dysks (0 no cap)");
+
+static unsigned int max_inflight_reqs = 4096;
+module_param(max_inflight_reqs, uint, 0644);
+MODULE_PARM_DESC(max_inflight_reqs, "Max requests in flight across all dysks (0 no cap)");
+
+static atomic64_t total_inflight_bytes = ATOMIC64_INIT(0);
+static atomic_t total_inflight_reqs    = ATOMIC_INIT(0);
+
+// current module wide usage, read only via /sys/module/<module>/parameters
+static int param_get_inflight_bytes(char *buffer, const struct kernel_param *kp)
+{
+  return sprintf(buffer, "%lld\n", (long long) atomic64_read(&total_inflight_bytes));
+}
+
+static int param_get_inflight_reqs(char *buffer, const struct kernel_param *kp)
+{
+  return sprintf(buffer, "%d\n", atomic_read(&total_inflight_reqs));
+}
+
+static const struct kernel_param_ops inflight_bytes_ops = {
+  .get = param_get_inflight_bytes,
+};
+
+static const struct kernel_param_ops inflight_reqs_ops = {
+  .get = param_get_inflight_reqs,
+};
+
+module_param_cb(inflight_bytes, &inflight_bytes_ops, NULL, 0444);
+module_param_cb(inflight_reqs, &inflight_reqs_ops, NULL, 0444);
+
+static inline long long budget_cost(struct request *req)
+{
+  long long cost = blk_rq_bytes(req);
+
+  if (READ == rq_data_dir(req)) cost += DYSK_BUDGET_RESPONSE_OVERHEAD;
+
+  return cost;
+}
+
+static inline int over_cap(long long used, long long cost, long long cap)
+{
+  return (0 != cap && used + cost > cap) ? 1 : 0;
+}
+
+// Charges a request against budget, returns 0 if request must wait
+int dysk_budget_charge(dysk *d, struct request *req)
+{
+  long long cost = budget_cost(req);
+  int reqs       = atomic_read(&d->inflight_reqs);
+  int total_reqs;
+  long long total_bytes;
+
+  // dysk's own caps, its submissions are serialized by queue lock
+  if (0 != reqs) {
+    if (over_cap(reqs, 1, dysk_max_inflight_reqs)) return 0;
+
+    if (over_cap(atomic64_read(&d->inflight_bytes), cost, (long long) dysk_max_inflight_mb << 20)) return 0;
+  }
+
+  // module wide caps are shared by all dysks, charge first then
+  // check so concurrent submitters can't overshoot them together
+  total_reqs  = atomic_inc_return(&total_inflight_reqs);
+  total_bytes = atomic64_add_return(cost, &total_inflight_bytes);
+
+  if (0 != reqs &&
+      (over_cap(total_reqs - 1, 1, max_inflight_reqs) ||
+       over_cap(total_bytes - cost, cost, (long long) max_inflight_mb << 20))) {
+    atomic_dec(&total_inflight_reqs);
+    atomic64_sub(cost, &total_inflight_bytes);
+    return 0;
+  }
+
+  atomic_inc(&d->inflight_reqs);
+  atomic64_add(cost, &d->inflight_bytes);
+  return 1;
+}
+
+void dysk_budget_release(dysk *d, struct request *req)
+{
+  long long cost = budget_cost(req);
+  atomic_dec(&d->inflight_reqs);
+  atomic64_sub(cost, &d->inflight_bytes);
+  atomic_dec(&total_inflight_reqs);
+  atomic64_sub(cost, &total_inflight_bytes);
+}
+
+// queue depth advertised to block layer, twice the budget so
+// requests waiting for budget can still be merged
+static unsigned long budget_queue_depth(void)
+{
+  unsigned long depth = BLKDEV_MAX_RQ;
+
+  if (0 != dysk_max_inflight_reqs) depth = 2 * (unsigned long) dysk_max_inflight_reqs;
+
+  return (BLKDEV_MIN_RQ > depth) ? BLKDEV_MIN_RQ : depth;
+}
+
+// sets queue depth the way the queue's nr_requests (sysfs) path does,
+// congestion thresholds follow the depth. Thresholds are computed as in
+// blk_queue_congestion_threshold() which is not available to modules
+static void set_queue_depth(struct request_queue *q, unsigned long depth)
+{
+  unsigned long nr;
+  q->nr_requests = depth;
+
+  nr = depth - (depth / 8) + 1;
+  q->nr_congestion_on = (nr > depth) ? depth : nr;
+
+  nr = depth - (depth / 8) - (depth / 16) - 1;
+  q->nr_congestion_off = (1 > nr) ? 1 : nr;
+}
+
+// ---------------------------------
+// Read gap filling
+// ---------------------------------
+/*
+ Reads that are close but not adjacent (block layer only merges adjacent
+ ones) are served by one ranged get. Bytes in gaps are read and dropped.
+ Each read in the span is still started, charged and completed on its own.
+*/
+#define DYSK_MAX_READ_SPAN_KB 4096
+
+static unsigned int read_gap_kb = 32;
+module_param(read_gap_kb, uint, 0644);
+MODULE_PARM_DESC(read_gap_kb, "Max KB gap between reads served by one ranged get (0 disables gap filling)");
+
+static unsigned int read_span_kb = 1024;
+module_param(read_span_kb, uint, 0644);
+MODULE_PARM_DESC(read_span_kb, "Max KB (including gaps) a ranged get covers when filling gaps");
+
+// can next be added to span first..last?
+static int read_span_fits(struct request *first, struct request *last, struct request *next)
+{
+  u64 last_end   = ((u64) blk_rq_pos(last) << 9) + blk_rq_bytes(last);
+  u64 next_start = ((u64) blk_rq_pos(next) << 9);
+  u64 span_kb    = min_t(unsigned int, read_span_kb, DYSK_MAX_READ_SPAN_KB);
+
+  if (0 == read_gap_kb || READ != rq_data_dir(next)) return 0;
+
+  if (next_start < last_end || next_start - last_end > ((u64) read_gap_kb << 10)) return 0;
+
+  return (next_start + blk_rq_bytes(next) - ((u64) blk_rq_pos(first) << 9) <= (span_kb << 10)) ? 1 : 0;
+}
+
+// ---------------------------------
+// Heat map
+// ---------------------------------
+/*
+ Optional per dysk access counters, the dysk is split in fixed regions
+ each counting reads, writes and bytes of requests that start in it.
+ Counters are updated in io_request (under queue lock) and halved every
+ heatmap_half_life_secs so the map follows the workload.
+ Dysks mounted while heatmap_regions is 0 have no heat map.
+*/
+#define DYSK_MAX_HEAT_REGIONS 65536
+
+static unsigned int heatmap_regions = 0;
+module_param(heatmap_regions, uint, 0644);
+MODULE_PARM_DESC(heatmap_regions, "Regions per dysk access heat map, read at mount (0 disables heat map)");
+
+static unsigned int heatmap_half_life_secs = 300;
+module_param(heatmap_half_life_secs, uint, 0644);
+MODULE_PARM_DESC(heatmap_half_life_secs, "Heat map counters are halved this often (0 never)");
+
+// applies every half life that passed since last decay, called with
+// queue lock held (on new i/o and when map is read, so quiet dysks cool down)
+static void heat_decay(dysk *d)
+{
+  unsigned long half_life = (unsigned long) heatmap_half_life_secs * HZ;
+  unsigned long periods;
+  unsigned int shift;
+  unsigned int i;
+
+  if (0 == half_life || !time_after(jiffies, d->heat_decayed_on + half_life)) return;
+
+  periods = (jiffies - d->heat_decayed_on) / half_life;
+  shift   = min_t(unsigned long, periods, 63);
+
+  for (i = 0; i < d->heat_regions; i++) {
+    d->heat[i].reads  >>= shift;
+    d->heat[i].writes >>= shift;
+    d->heat[i].bytes  >>= shift;
+  }
+
+  d->heat_decayed_on += periods * half_life;
+}
+
+// called with queue lock held
+static void heat_record(dysk *d, struct request *req)
+{
+  dysk_heat_region *region;
+
+  if (!d->heat) return;
+
+  heat_decay(d);
+
+  region = &d->heat[min_t(u64, div64_u64(blk_rq_pos(req), d->heat_region_sectors), d->heat_regions - 1)];
+
+  if (WRITE == rq_data_dir(req))
+    region->writes++;
+  else
+    region->reads++;
+
+  region->bytes += blk_rq_bytes(req);
+}
+
+// "<first sector> <last sector> <reads> <writes> <bytes>" per touched region
+static int heatmap_show(struct seq_file *m, void *unused)
+{
+  dysk *d = (dysk *) m->private;
+  unsigned int i;
+  spin_lock_irq(&d->lock);
+  heat_decay(d);
+  spin_unlock_irq(&d->lock);
+  seq_printf(m, "regions %u region_sectors %llu\n", d->heat_regions, d->heat_region_sectors);
+
+  for (i = 0; i < d->heat_regions; i++) {
+    dysk_heat_region region = d->heat[i];
+
+    if (0 == region.reads && 0 == region.writes) continue;
+
+    seq_printf(m, "%llu %llu %llu %llu %llu\n",
+               i * d->heat_region_sectors,
+               (i + 1) * d->heat_region_sectors - 1,
+               region.reads,
+               region.writes,
+               region.bytes);
+  }
+
+  return 0;
+}
+
+static int heatmap_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, heatmap_show, inode->i_private);
+}
+
+static const struct file_operations heatmap_fops = {
+  .owner   = THIS_MODULE,
+  .open    = heatmap_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+// allocates heat map if enabled, dysk works without it
+static void heat_init(dysk *d)
+{
+  unsigned int regions = min_t(unsigned int, heatmap_regions, DYSK_MAX_HEAT_REGIONS);
+
+  if (0 == regions || 0 == d->def->sector_count) return;
+
+  regions = min_t(u64, regions, d->def->sector_count);
+  d->heat = vzalloc(regions * sizeof(dysk_heat_region));
+
+  if (!d->heat) {
+    printk(KERN_INFO "dysk: %s has no heat map, no memory", d->def->deviceName);
+    return;
+  }
+
+  d->heat_regions        = regions;
+  d->heat_region_sectors = DIV_ROUND_UP_ULL((u64) d->def->sector_count, regions);
+  d->heat_decayed_on     = jiffies;
+  debugfs_create_file("heatmap", 0444, d->debugfs, d, &heatmap_fops);
+}
+
+// ---------------------------------
+// I/O trace
+// ---------------------------------
+/*
+ Optional per dysk ring of the last trace_entries requests as accepted
+ by io_request (sector, size, direction, flags and time since previous
+ request), so a production access pattern can be captured and replayed
+ elsewhere (dyskctl replay). Readers of /sys/kernel/debug/dysk/<dysk>/trace
+ get a snapshot taken at open, writing anything to it restarts the trace.
+ Dysks mounted while trace_entries is 0 are not traced.
+*/
+#define DYSK_MAX_TRACE_ENTRIES (1 << 20)
+
+static unsigned int trace_entries = 0;
+module_param(trace_entries, uint, 0644);
+MODULE_PARM_DESC(trace_entries, "Requests kept in per dysk i/o trace, read at mount (0 disables trace)");
+
+// ring position of nth record
+static u32 trace_slot(dysk *d, u64 n)
+{
+  u32 slot;
+  div_u64_rem(n, d->trace_entries, &slot);
+  return slot;
+}
+
+// called with queue lock held
+static void trace_record(dysk *d, struct request *req)
+{
+  dysk_trace_rec *rec;
+  u64 now;
+  u64 delta_us = 0;
+
+  if (!d->trace) return;
+
+  now = ktime_get_ns();
+
+  if (0 != d->trace_recorded) delta_us = div_u64(now - d->trace_last_ns, NSEC_PER_USEC);
+
+  rec           = &d->trace[trace_slot(d, d->trace_recorded)];
+  rec->sector   = blk_rq_pos(req);
+  rec->bytes    = blk_rq_bytes(req);
+  rec->delta_us = (u32) min_t(u64, delta_us, U32_MAX);
+  rec->flags    = (WRITE == rq_data_dir(req)) ? DYSK_TRACE_WRITE : 0;
+  rec->seq      = (u32) d->trace_recorded;
+
+  if (req->cmd_flags & REQ_SYNC) rec->flags |= DYSK_TRACE_SYNC;
+  if (req->cmd_flags & REQ_FUA) rec->flags |= DYSK_TRACE_FUA;
+  if (req->cmd_flags & REQ_META) rec->flags |= DYSK_TRACE_META;
+
+  d->trace_recorded++;
+  d->trace_last_ns = now;
+}
+
+// snapshot: header + records oldest first
+struct dysk_trace_snapshot {
+  size_t size;
+  char data[];
+};
+
+static int trace_open(struct inode *inode, struct file *file)
+{
+  dysk *d = (dysk *) inode->i_private;
+  struct dysk_trace_snapshot *snap;
+  struct dysk_trace_hdr *hdr;
+  dysk_trace_rec *recs;
+  u64 first;
+  u32 count;
+  u32 i;
+  size_t size = sizeof(struct dysk_trace_hdr) + (size_t) d->trace_entries * sizeof(dysk_trace_rec);
+
+  // write only opens (restart) need no snapshot
+  if (!(file->f_mode & FMODE_READ)) return 0;
+
+  snap = vmalloc(sizeof(struct dysk_trace_snapshot) + size);
+
+  if (!snap) return -ENOMEM;
+
+  hdr  = (struct dysk_trace_hdr *) snap->data;
+  recs = (dysk_trace_rec *) (snap->data + sizeof(struct dysk_trace_hdr));
+  spin_lock_irq(&d->lock);
+  count = (u32) min_t(u64, d->trace_recorded, d->trace_entries);
+  first = d->trace_recorded - count;
+
+  for (i = 0; i < count; i++)
+    recs[i] = d->trace[trace_slot(d, first + i)];
+
+  hdr->recorded = d->trace_recorded;
+  spin_unlock_irq(&d->lock);
+
+  hdr->magic       = DYSK_TRACE_MAGIC;
+  hdr->version     = DYSK_TRACE_VERSION;
+  hdr->record_size = sizeof(dysk_trace_rec);
+  hdr->count       = count;
+  hdr->capacity    = d->trace_entries;
+  snap->size       = sizeof(struct dysk_trace_hdr) + (size_t) count * sizeof(dysk_trace_rec);
+  file->private_data = snap;
+  return 0;
+}
+
+static ssize_t trace_read(struct file *file, char __user *buf, size_t len, loff_t *pos)
+{
+  struct dysk_trace_snapshot *snap = (struct dysk_trace_snapshot *) file->private_data;
+
+  if (!snap) return -EINVAL;
+
+  return simple_read_from_buffer(buf, len, pos, snap->data, snap->size);
+}
+
+// any write restarts the trace
+static ssize_t trace_write(struct file *file, const char __user *buf, size_t len, loff_t *pos)
+{
+  dysk *d = (dysk *) file_inode(file)->i_private;
+  spin_lock_irq(&d->lock);
+  d->trace_recorded = 0;
+  d->trace_last_ns  = 0;
+  spin_unlock_irq(&d->lock);
+  return len;
+}
+
+static int trace_release(struct inode *inode, struct file *file)
+{
+  vfree(file->private_data);
+  return 0;
+}
+
+static const struct file_operations trace_fops = {
+  .owner   = THIS_MODULE,
+  .open    = trace_open,
+  .read    = trace_read,
+  .write   = trace_write,
+  .llseek  = default_llseek,
+  .release = trace_release,
+};
+
+// allocates trace ring if enabled, dysk works without it
+static void trace_init(dysk *d)
+{
+  unsigned int entries = min_t(unsigned int, trace_entries, DYSK_MAX_TRACE_ENTRIES);
+
+  if (0 == entries) return;
+
+  d->trace = vzalloc((size_t) entries * sizeof(dysk_trace_rec));
+
+  if (!d->trace) {
+    printk(KERN_INFO "dysk: %s has no i/o trace, no memory", d->def->deviceName);
+    return;
+  }
+
+  d->trace_entries  = entries;
+  d->trace_recorded = 0;
+  d->trace_last_ns  = 0;
+  debugfs_create_file("trace", 0600, d->debugfs, d, &trace_fops);
+}
+
+// per dysk usage in /sys/block/<dysk>/dysk/
+static ssize_t inflight_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  dysk *d = (dysk *) dev_to_disk(dev)->private_data;
+  return sprintf(buf, "%lld\n", (long long) atomic64_read(&d->inflight_bytes));
+}
+
+static ssize_t inflight_reqs_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  dysk *d = (dysk *) dev_to_disk(dev)->private_data;
+  return sprintf(buf, "%d\n", atomic_read(&d->inflight_reqs));
+}
+
+static DEVICE_ATTR_RO(inflight_bytes);
+static DEVICE_ATTR_RO(inflight_reqs);
+
+// ---------------------------------
+// I/O stats
+// ---------------------------------
+void dysk_stats_request_done(dysk *d, struct request *req, u64 start_ns, int err)
+{
+  int dir = rq_data_dir(req);
+  u64 us  = div_u64(ktime_get_ns() - start_ns, NSEC_PER_USEC);
+  int bucket;
+
+  if (0 != err) {
+    dysk_stat_inc(d, errors[dir]);
+
+    if (-EAGAIN == err) dysk_stat_inc(d, timeouts);
+
+    return;
+  }
+
+  bucket = min_t(int, fls64(us), DYSK_LAT_BUCKETS - 1);
+  dysk_stat_inc(d, ops[dir]);
+  dysk_stat_add(d, bytes[dir], blk_rq_bytes(req));
+  dysk_stat_inc(d, latency[dir][bucket]);
+}
+
+// sums a counter (at offset) across cpus
+static u64 dysk_stat_sum(dysk *d, size_t offset)
+{
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += *(u64 *) ((char *) per_cpu_ptr(d->stats, cpu) + offset);
+
+  return sum;
+}
+
+#define DYSK_STAT_ATTR(_name, _field)                                                        \
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)    \
+{                                                                                            \
+  dysk *d = (dysk *) dev_to_disk(dev)->private_data;                                         \
+  return sprintf(buf, "%llu\n", dysk_stat_sum(d, offsetof(dysk_stats, _field)));            \
+}                                                                                            \
+static DEVICE_ATTR_RO(_name)
+
+DYSK_STAT_ATTR(reads,         ops[READ]);
+DYSK_STAT_ATTR(writes,        ops[WRITE]);
+DYSK_STAT_ATTR(read_bytes,    bytes[READ]);
+DYSK_STAT_ATTR(write_bytes,   bytes[WRITE]);
+DYSK_STAT_ATTR(read_errors,   errors[READ]);
+DYSK_STAT_ATTR(write_errors,  errors[WRITE]);
+DYSK_STAT_ATTR(resends,       resends);
+DYSK_STAT_ATTR(conn_failures, conn_failures);
+DYSK_STAT_ATTR(throttles,     throttles);
+DYSK_STAT_ATTR(throttled_ms,  throttled_ms);
+DYSK_STAT_ATTR(timeouts,      timeouts);
+
+// one "<bucket upper bound us> <count>" line per bucket, last bound is 0 (no bound)
+static ssize_t latency_show(dysk *d, int dir, char *buf)
+{
+  ssize_t len = 0;
+  int bucket;
+
+  for (bucket = 0; bucket < DYSK_LAT_BUCKETS; bucket++) {
+    len += sprintf(buf + len, "%llu %llu\n",
+                   (DYSK_LAT_BUCKETS - 1 == bucket) ? 0ULL : 1ULL << bucket,
+                   dysk_stat_sum(d, offsetof(dysk_stats, latency[dir][bucket])));
+  }
+
+  return len;
+}
+
+static ssize_t read_latency_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return latency_show((dysk *) dev_to_disk(dev)->private_data, READ, buf);
+}
+
+static ssize_t write_latency_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return latency_show((dysk *) dev_to_disk(dev)->private_data, WRITE, buf);
+}
+
+// transports without connections report 0
+static void connection_stats(dysk *d, unsigned int *live, unsigned int *peak)
+{
+  *live = 0;
+  *peak = 0;
+
+  if (d->xfer->connection_stats) d->xfer->connection_stats(d, live, peak);
+}
+
+static ssize_t connections_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  unsigned int live, peak;
+  connection_stats((dysk *) dev_to_disk(dev)->private_data, &live, &peak);
+  return sprintf(buf, "%u\n", live);
+}
+
+static ssize_t peak_connections_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  unsigned int live, peak;
+  connection_stats((dysk *) dev_to_disk(dev)->private_data, &live, &peak);
+  return sprintf(buf, "%u\n", peak);
+}
+
+static ssize_t transport_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  dysk *d = (dysk *) dev_to_disk(dev)->private_data;
+  return sprintf(buf, "%s\n", d->xfer->name);
+}
+
+static DEVICE_ATTR_RO(read_latency_us);
+static DEVICE_ATTR_RO(write_latency_us);
+static DEVICE_ATTR_RO(connections);
+static DEVICE_ATTR_RO(peak_connections);
+static DEVICE_ATTR_RO(transport);
+
+static struct attribute *dysk_attrs[] = {
+  &dev_attr_inflight_bytes.attr,
+  &dev_attr_inflight_reqs.attr,
+  &dev_attr_reads.attr,
+  &dev_attr_writes.attr,
+  &dev_attr_read_bytes.attr,
+  &dev_attr_write_bytes.attr,
+  &dev_attr_read_errors.attr,
+  &dev_attr_write_errors.attr,
+  &dev_attr_resends.attr,
+  &dev_attr_conn_failures.attr,
+  &dev_attr_throttles.attr,
+  &dev_attr_throttled_ms.attr,
+  &dev_attr_timeouts.attr,
+  &dev_attr_read_latency_us.attr,
+  &dev_attr_write_latency_us.attr,
+  &dev_attr_connections.attr,
+  &dev_attr_peak_connections.attr,
+  &dev_attr_transport.attr,
+  NULL,
+};
+
+static struct attribute_group dysk_attr_group = {
+  .name  = "dysk",
+  .attrs = dysk_attrs,
+};
+
 // finds and mark slot as busy
 static int find_set_dysk_slots(void)
 {
@@ -190,21 +827,53 @@ task_result __del_dysk_async(w_task *this_task)
   // that all tasks has been canceled
   if (2 >= dyskdelstate->counter) return retry_later;
 
+  // and worker no longer serves this dysk's queue
+  if (0 == dysk_worker_detach(dyskdelstate->d->worker, dyskdelstate->d)) return retry_later;
+
   // done, actual delete
-  az_teardown_for_dysk(dyskdelstate->d); // tell azure library we are deleteing
+  dyskdelstate->d->xfer->teardown_for_dysk(dyskdelstate->d); // tell transport we are deleting
+  debugfs_remove_recursive(dyskdelstate->d->debugfs);
+  vfree(dyskdelstate->d->heat);
+  vfree(dyskdelstate->d->trace);
   io_unhook(dyskdelstate->d); // unhook it from kernel scheduler
 
   if (dyskdelstate->d->def) kfree(dyskdelstate->d->def); // free def
 
+  free_percpu(dyskdelstate->d->stats);
+
   kfree(dyskdelstate->d); // destroy dysk
   return done;
 }
 
 // Sync part
+// deletes a dysk its caller claimed (status moved off DYSK_OK)
+static void dysk_del_claimed(dysk *d, __dyskdelstate *dyskdelstate)
+{
+  sysfs_remove_group(&disk_to_dev(d->gd)->kobj, &dysk_attr_group);
+  del_gendisk(d->gd);
+  // remove it from list
+  spin_lock(&dysks.lock);
+  list_del(&d->list);
+  spin_unlock(&dysks.lock);
+  // setup async part
+  dyskdelstate->d = d;
+
+  // we can not fail here, if no mem keep trying
+  while (0 != queue_w_task(NULL,
+                           &dysks.head /* we send head because it is always healthy dummy dysk */,
+                           NULL,
+                           &__del_dysk_async,
+                           NULL /* we depend on genearl purpose clean func */,
+                           no_throttle,
+                           dyskdelstate))
+    ;
+}
+
 static int dysk_del(char *name, char *error)
 {
   const char *ERR_DYSK_DOES_NOT_EXIST = "Failed to unmount dysk, device with name:%s does not exists";
   const char *ERR_DYSK_DEL_NO_MEM = "No memory to delete dysk:%s";
+  const char *ERR_DYSK_DELETING   = "Failed to unmount dysk:%s, it is already being deleted";
   dysk *d = NULL;
   __dyskdelstate *dyskdelstate = NULL;
   dyskdelstate = kmalloc(sizeof(__dyskdelstate), GFP_KERNEL);
@@ -223,25 +892,15 @@ static int dysk_del(char *name, char *error)
     return -1;
   }
 
-  // set to delete
-  d->status = DYSK_DELETING;
-  del_gendisk(d->gd);
-  // remove it from list
-  spin_lock(&dysks.lock);
-  list_del(&d->list);
-  spin_unlock(&dysks.lock);
-  // setup async part
-  dyskdelstate->d = d;
-
-  // we can not fail here, if no mem keep trying
-  while (0 != queue_w_task(NULL,
-                           &dysks.head /* we send head because it is always healthy dummy dysk */,
-                           &__del_dysk_async,
-                           NULL /* we depend on genearl purpose clean func */,
-                           no_throttle,
-                           dyskdelstate))
-    ;
+  // set to delete, only one of concurrent deleters (unmount, catastrophe
+  // raised by send or receive stage) gets through
+  if (DYSK_OK != cmpxchg(&d->status, DYSK_OK, DYSK_DELETING)) {
+    sprintf(error, ERR_DYSK_DELETING, name);
+    kfree(dyskdelstate);
+    return -1;
+  }
 
+  dysk_del_claimed(d, dyskdelstate);
   return 0;
 }
 // Adds a dysk
@@ -258,33 +917,67 @@ static int dysk_add(dysk *d, char *error)
   }
 
   spin_lock_init(&d->lock);
-  d->worker        = &default_worker;
+  d->worker        = pick_worker();
+  d->latency_target = msecs_to_jiffies(d->def->latency_target_ms);
+  d->latency_ewma   = 0;
+  atomic_set(&d->pending_reqs, 0);
+  atomic64_set(&d->inflight_bytes, 0);
+  atomic_set(&d->inflight_reqs, 0);
+
+  if (!(d->stats = alloc_percpu(dysk_stats))) {
+    sprintf(error, ERR_DYSK_ADD, d->def->deviceName, -ENOMEM);
+    return -1;
+  }
+
+  d->debugfs = debugfs_create_dir(d->def->deviceName, dysk_debugfs);
+  heat_init(d);
+  trace_init(d);
 
   // init Dysk
-  if (0 != (success = az_init_for_dysk(d))) {
-    printk(KERN_ERR "Failed to az_init dysk:%s", d->def->deviceName);
+  d->xfer = xfers[d->def->transport];
+
+  if (0 != (success = d->xfer->init_for_dysk(d))) {
+    printk(KERN_ERR "Failed to init %s transport of dysk:%s", d->xfer->name, d->def->deviceName);
     sprintf(error, ERR_DYSK_ADD, d->def->deviceName, success);
     //az_teardown_for_dysk(d);
-    return -1;
+    goto free_stats;
   }
 
+  // worker serves the dysk before it is hooked, add_disk()
+  // starts i/o (partition scan) right away
+  dysk_worker_attach(d->worker, d, d->def->weight);
+
   if (0 != (success = io_hook(d))) {
     printk(KERN_ERR "Failed to hook dysk:%s", d->def->deviceName);
     sprintf(error, ERR_DYSK_ADD, d->def->deviceName, success);
-    az_teardown_for_dysk(d);
-    return -1;
+
+    // worker may be walking its queues, wait until it drops this one
+    while (0 == dysk_worker_detach(d->worker, d)) msleep(1);
+
+    d->xfer->teardown_for_dysk(d);
+    goto free_stats;
   }
 
   spin_lock(&dysks.lock);
   list_add(&d->list, &dysks.head.list);
   spin_unlock(&dysks.lock);
   return 0;
+free_stats:
+  debugfs_remove_recursive(d->debugfs);
+  d->debugfs = NULL;
+  vfree(d->heat);
+  d->heat = NULL;
+  vfree(d->trace);
+  d->trace = NULL;
+  free_percpu(d->stats);
+  d->stats = NULL;
+  return -1;
 }
 // Dysk def to buffer for Endpoint IOCTL
 void dysk_def_to_buffer(dysk_def *dd, char *buffer)
 {
-  //type-devicename-sectorcount-accountname-sas-path-host-ip-lease-major-minor
-  const char *format = "%s\n%s\n%lu\n%s\n%s\n%s\n%s\n%s\n%s\n%d\n%d\n%d\n";
+  //type-devicename-sectorcount-accountname-sas-path-host-ip-lease-major-minor-vhd-weight-latencytarget-poll-port-transport
+  const char *format = "%s\n%s\n%lu\n%s\n%s\n%s\n%s\n%s\n%s\n%d\n%d\n%d\n%u\n%u\n%u\n%u\n%u\n";
   sprintf(buffer, format,
           (0 == dd->readOnly) ? "RW" : "R",
           dd->deviceName,
@@ -297,7 +990,33 @@ void dysk_def_to_buffer(dysk_def *dd, char *buffer)
           dd->lease_id,
           dd->major,
           dd->minor,
-          dd->is_vhd);
+          dd->is_vhd,
+          dd->weight,
+          dd->latency_target_ms,
+          dd->poll_us,
+          dd->port,
+          dd->transport);
+}
+// Reads an optional unsigned line, older clients don't send trailing lines.
+// returns -1 if line is there but invalid or out of [min, max]
+static int optional_uint_from_buffer(char *buffer, int *idx, unsigned int *value, unsigned int def, unsigned int min, unsigned int max)
+{
+  char line[LINE_LENGTH] = {0};
+  int cut = 0;
+  *value = def;
+  cut = get_until(buffer + *idx, n, line, LINE_LENGTH);
+
+  if (-1 == cut) return 0;
+
+  *idx += cut + strlen(n);
+
+  if (0 == cut) return 0;
+
+  line[LINE_LENGTH - 1] = '\0';
+
+  if (1 != sscanf(line, "%u", value) || *value < min || *value > max) return -1;
+
+  return 0;
 }
 // Dysk def from buffer -- Endpoint IOCTL
 int dysk_def_from_buffer(char *buffer, size_t len, dysk_def *dd, char *error)
@@ -312,6 +1031,11 @@ int dysk_def_from_buffer(char *buffer, size_t len, dysk_def *dd, char *error)
   const char *ERR_IP           = "Can't determine ip";
   const char *ERR_LEASE_ID     = "Can't determine lease";
   const char *ERR_VHD          = "Can't determine vhd";
+  const char *ERR_WEIGHT       = "Invalid weight";
+  const char *ERR_LATENCY      = "Invalid latency target";
+  const char *ERR_POLL         = "Invalid poll time";
+  const char *ERR_PORT         = "Invalid port";
+  const char *ERR_TRANSPORT    = "Invalid transport";
   char line[LINE_LENGTH] = {0};
   int cut       = 0;
   int idx       = 0;
@@ -427,6 +1151,37 @@ int dysk_def_from_buffer(char *buffer, size_t len, dysk_def *dd, char *error)
   }
 
   idx += cut + strlen(n);
+
+  // weight (optional)
+  if (0 != optional_uint_from_buffer(buffer, &idx, &dd->weight, DYSK_DEFAULT_WEIGHT, DYSK_MIN_WEIGHT, DYSK_MAX_WEIGHT)) {
+    memcpy(error, ERR_WEIGHT, strlen(ERR_WEIGHT));
+    return -1;
+  }
+
+  // latency target (optional)
+  if (0 != optional_uint_from_buffer(buffer, &idx, &dd->latency_target_ms, 0, 0, DYSK_MAX_LATENCY_TARGET_MS)) {
+    memcpy(error, ERR_LATENCY, strlen(ERR_LATENCY));
+    return -1;
+  }
+
+  // polled mode (optional)
+  if (0 != optional_uint_from_buffer(buffer, &idx, &dd->poll_us, 0, 0, DYSK_MAX_POLL_US)) {
+    memcpy(error, ERR_POLL, strlen(ERR_POLL));
+    return -1;
+  }
+
+  // endpoint port (optional)
+  if (0 != optional_uint_from_buffer(buffer, &idx, &dd->port, DYSK_DEFAULT_PORT, 1, 65535)) {
+    memcpy(error, ERR_PORT, strlen(ERR_PORT));
+    return -1;
+  }
+
+  // transport (optional)
+  if (0 != optional_uint_from_buffer(buffer, &idx, &dd->transport, DYSK_XFER_AZ, DYSK_XFER_AZ, DYSK_XFER_MAX)) {
+    memcpy(error, ERR_TRANSPORT, strlen(ERR_TRANSPORT));
+    return -1;
+  }
+
   return 0;
 }
 
@@ -799,10 +1554,32 @@ int endpoint_start(void)
 // Dysk: Request Mgmt
 // ------------------------------------------
 // Moves a request from kernel queue to dysk
+/*
+ Accounts for a request taken off block layer queue (tracepoint, heat map,
+ i/o trace). Requests the transport did not take are requeued and taken
+ again later, they are only accounted the first time. req->special (ours
+ for fs requests, zeroed by block layer) marks them until completion.
+*/
+#define DYSK_RQ_ACCEPTED ((void *) 1)
+
+static void io_accept(dysk *d, struct request *req)
+{
+  if (DYSK_RQ_ACCEPTED == req->special) return;
+
+  req->special = DYSK_RQ_ACCEPTED;
+  trace_dysk_rq_accept(d, req, 0);
+  heat_record(d, req);
+  trace_record(d, req);
+}
+
 static void io_request(struct request_queue *q)
 {
   struct request *req = NULL;
+  struct request *span[DYSK_SPAN_MAX];
+  int span_count      = 0;
   dysk *d             = NULL;
+  int success         = 0;
+  int last            = 0;
   d = (dysk *) q->queuedata;
 
   while (NULL != (req = blk_peek_request(q))) {
@@ -834,9 +1611,57 @@ static void io_request(struct request_queue *q)
       continue;
     }
 
-    // if queue accepted the request..
-    if (0 == az_do_request(d, req))
-      blk_start_request(req);
+    // dysk is behind its latency target, leave requests
+    // in block layer queue (to be merged) until it catches up
+    if (0 == dysk_worker_admit(d)) {
+      blk_delay_queue(q, DYSK_QUEUE_DELAY_MS);
+      break;
+    }
+
+    // dysk or module is out of in-flight budget
+    if (0 == dysk_budget_charge(d, req)) {
+      blk_delay_queue(q, DYSK_QUEUE_DELAY_MS);
+      break;
+    }
+
+    // request is started before it is submitted, submission runs
+    // without queue lock since it may send the request right away
+    blk_start_request(req);
+    io_accept(d, req);
+    span[0]    = req;
+    span_count = 1;
+
+    // reads queued right behind with small gaps ride the same get
+    while (READ == rq_data_dir(req) && DYSK_SPAN_MAX > span_count) {
+      struct request *next = blk_peek_request(q);
+
+      if (!next || !read_span_fits(req, span[span_count - 1], next)) break;
+
+      if (0 == dysk_budget_charge(d, next)) break;
+
+      blk_start_request(next);
+      io_accept(d, next);
+      span[span_count++] = next;
+    }
+
+    // only the last request of a batch is polled for, polling for
+    // others would hold the rest of the batch back (queue depth 1)
+    last = (NULL == blk_peek_request(q));
+
+    spin_unlock_irq(q->queue_lock);
+    success = d->xfer->do_request(d, span, span_count, last);
+    spin_lock_irq(q->queue_lock);
+
+    // if queue did not accept the request..
+    if (0 != success) {
+      while (0 < span_count--) {
+        dysk_budget_release(d, span[span_count]);
+        blk_requeue_request(q, span[span_count]);
+      }
+
+      blk_delay_queue(q, DYSK_QUEUE_DELAY_MS);
+      break;
+    }
   }
 }
 // Set dysk in catastrophe mode, and delete it
@@ -844,25 +1669,50 @@ static void io_request(struct request_queue *q)
 // will get EIO then disk will disappear
 void dysk_catastrophe(dysk *d)
 {
-  char dummy[256] = {0};
-  int success;
-  d->status = DYSK_CATASTROPHE;
-  printk(KERN_ERR "dysk:%s is entered catastrophe mode", d->def->deviceName);
+  __dyskdelstate *dyskdelstate = NULL;
 
-  // Keep trying to delete until either deleted by us or somebody else
-  while (1) {
-    success = dysk_del(d->def->deviceName, (char *) &dummy);
+  // already being deleted (by user, or an earlier catastrophe)
+  if (DYSK_OK != cmpxchg(&d->status, DYSK_OK, DYSK_CATASTROPHE)) return;
 
-    if (-1 == success || 0 == success) break;
-  }
+  printk(KERN_ERR "dysk:%s is entered catastrophe mode", d->def->deviceName);
+
+  // Keep trying until we have memory to delete it
+  while (NULL == (dyskdelstate = kmalloc(sizeof(__dyskdelstate), GFP_KERNEL)))
+    cond_resched();
 
+  memset(dyskdelstate, 0, sizeof(__dyskdelstate));
+  dysk_del_claimed(d, dyskdelstate);
   printk(KERN_ERR "Catastrophe dysk deleted!");
 }
 
 // All our requests are atomic (all or none)
+/*
+ Requests are completed in block softirq on the cpu that
+ submitted them (not on worker's cpu), the error is carried
+ in req->special which is ours for fs requests.
+*/
+static void io_softirq_done(struct request *req)
+{
+  blk_end_request_all(req, (int) (long) req->special);
+}
+
 void io_end_request(dysk *d, struct request *req, int err)
 {
-  blk_end_request_all(req, err);
+  trace_dysk_rq_complete(d, req, err);
+  req->special = (void *) (long) err;
+  blk_complete_request(req);
+}
+
+void io_end_span(w_task *this_task, struct request **span, int span_count, u64 start_ns, int err)
+{
+  int i;
+  dysk_worker_request_done(this_task, err);
+
+  for (i = 0; i < span_count; i++) {
+    dysk_stats_request_done(this_task->d, span[i], start_ns, err);
+    dysk_budget_release(this_task->d, span[i]);
+    io_end_request(this_task->d, span[i], err);
+  }
 }
 
 // -------------------------------------------
@@ -920,10 +1770,16 @@ int io_hook(dysk *d)
   }
 
   d->slot = slot;
-  rq = blk_init_queue(io_request, &d->lock);
+  rq = blk_init_queue_node(io_request, &d->lock, d->worker->node);
 
   if (!rq) goto clean_no_mem;
 
+  // complete requests on the cpu that submitted them
+  queue_flag_set_unlocked(QUEUE_FLAG_SAME_COMP, rq);
+  queue_flag_set_unlocked(QUEUE_FLAG_SAME_FORCE, rq);
+  blk_queue_softirq_done(rq, io_softirq_done);
+
+  set_queue_depth(rq, budget_queue_depth());
   blk_queue_max_hw_sectors(rq, 2 * 1024 * 4);   /* 4 megs */
   blk_queue_physical_block_size(rq, 512);
   blk_queue_io_min(rq, 512);
@@ -936,7 +1792,7 @@ int io_hook(dysk *d)
   blk_queue_max_discard_sectors(rq, 0);
   blk_queue_max_write_same_sectors(rq, 0);
   rq->queuedata = d;
-  gd = alloc_disk(DYSK_MINORS);
+  gd = alloc_disk_node(DYSK_MINORS, d->worker->node);
 
   if (!gd) goto clean_no_mem;
 
@@ -960,6 +1816,11 @@ int io_hook(dysk *d)
 
   // add it
   add_disk(gd);
+
+  // usage is informational, dysk works without it
+  if (0 != sysfs_create_group(&disk_to_dev(gd)->kobj, &dysk_attr_group))
+    printk(KERN_WARNING "dysk: failed to create sysfs attributes for %s", d->def->deviceName);
+
   printk(KERN_NOTICE "dysk: disk with name %s was created", d->def->deviceName);
   return 0;
 clean_no_mem:
@@ -995,8 +1856,19 @@ int io_unhook(dysk *d)
 
 static void unload(void)
 {
+  int node;
   // Worker tear down
-  dysk_worker_teardown(&default_worker);
+  for_each_node(node) {
+    if (!workers[node]) continue;
+
+    dysk_worker_teardown(workers[node]);
+    kfree(workers[node]);
+    workers[node] = NULL;
+  }
+
+  debugfs_remove_recursive(dysk_debugfs);
+  dysk_debugfs = NULL;
+
   // stop endpoint
   endpoint_stop();
 
@@ -1010,6 +1882,7 @@ static void unload(void)
 static int __init _init_module(void)
 {
   int success = 0;
+  int node;
   INIT_LIST_HEAD(&dysks.head.list);
   spin_lock_init(&dysks.lock);
 
@@ -1034,15 +1907,26 @@ static int __init _init_module(void)
     return -1;
   }
 
-  if (0 != (success = dysk_worker_init(&default_worker))) {
-    printk(KERN_ERR "dysk: failed to init the worker, module is in failed state");
-    unload();
-    return success;
+  // debugfs is best effort, dysk works without it
+  dysk_debugfs = debugfs_create_dir("dysk", NULL);
+
+  // workers, on nodes that have cpus
+  for_each_online_node(node) {
+    if (cpumask_empty(cpumask_of_node(node))) continue;
+
+    workers[node] = kzalloc_node(sizeof(dysk_worker), GFP_KERNEL, node);
+
+    if (!workers[node] || 0 != (success = dysk_worker_init(workers[node], node))) {
+      printk(KERN_ERR "dysk: failed to init the worker for node %d, module is in failed state", node);
+      unload();
+      return (0 != success) ? success : -ENOMEM;
+    }
   }
 
   // Although the head does not do anywork, we need it
   // during delete dysk routing check dysk_del(..)
-  dysks.head.worker = &default_worker;
+  dysks.head.worker = pick_worker();
+  dysk_worker_attach(dysks.head.worker, &dysks.head, DYSK_DEFAULT_WEIGHT);
   dysks.count = -1;
   printk(KERN_INFO "dysk init routine completed successfully");
   return 0;
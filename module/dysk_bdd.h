@@ -9,6 +9,10 @@
 
 //Completion variables
 #include <linux/completion.h>
+#include <linux/llist.h>
+#include <linux/timer.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
 
 #define KERNEL_SECTOR_SIZE 512
 
@@ -21,6 +25,40 @@
 #define IP_LEN             32
 #define LEASE_ID_LEN       64
 
+// Worker scheduling weights (per dysk)
+#define DYSK_MIN_WEIGHT     1
+#define DYSK_MAX_WEIGHT     1000
+#define DYSK_DEFAULT_WEIGHT 100
+
+// Priority lanes (per dysk), lower is served first
+#define DYSK_LANE_RT         0 // realtime class, metadata and worker control tasks
+#define DYSK_LANE_SYNC       1 // synchronous i/o (reads, O_SYNC/O_DIRECT writes)
+#define DYSK_LANE_ASYNC      2 // background writeback and idle class
+#define DYSK_LANES           3
+#define DYSK_LANE_MAX_STARVE 8 // rounds a lane can be skipped before it is served first
+
+// Latency targets (per dysk), 0 means best effort
+#define DYSK_MAX_LATENCY_TARGET_MS 60000
+
+// Polled mode (per dysk), max time submitter polls for a response. 0 is off
+#define DYSK_MAX_POLL_US 5000
+
+// Storage endpoint port, when not given at mount
+#define DYSK_DEFAULT_PORT 80
+
+// Transports (per dysk), picked at mount
+#define DYSK_XFER_AZ   0 // page blob over http (az.c)
+#define DYSK_XFER_NULL 1 // completes requests right away, keeps nothing (mem.c)
+#define DYSK_XFER_RAM  2 // keeps data in memory (mem.c)
+#define DYSK_XFER_MAX  DYSK_XFER_RAM
+
+// Max reads served by one ranged get (gap filling)
+#define DYSK_SPAN_MAX 8
+
+// Latency histogram buckets (per dysk per op), bucket n counts
+// requests that took < 2^n us, last bucket takes the rest
+#define DYSK_LAT_BUCKETS 24
+
 #define DYSK_OK          0 // Healthy and working
 #define DYSK_DELETING    1 // Deleting based on user request
 #define DYSK_CATASTROPHE 2 // Something is wrong with connection, lease etc.
@@ -42,8 +80,26 @@ typedef struct dysk_worker dysk_worker;
 // a task is a unit of work for dysk_worker
 typedef struct w_task w_task;
 
+// per dysk queue of tasks served by dysk_worker
+typedef struct dysk_runq dysk_runq;
+// I/O counters of a dysk (per cpu)
+typedef struct dysk_stats dysk_stats;
+// access counters of a dysk region (heat map)
+typedef struct dysk_heat_region dysk_heat_region;
+// one block request as recorded in a dysk's i/o trace
+typedef struct dysk_trace_rec dysk_trace_rec;
+// worker stage self profiling
+typedef struct w_stage_prof w_stage_prof;
+// moves requests of a dysk to and from its backing store
+typedef struct dysk_xfer dysk_xfer;
+
+// per cpu free tasks (dysk_worker.c)
+struct w_task_cache;
+
 // Ends an io request
 void io_end_request(dysk *d, struct request *req, int err);
+// Ends every request of a span served by this_task, start_ns is when it was accepted
+void io_end_span(w_task *this_task, struct request **span, int span_count, u64 start_ns, int err);
 
 // sets dysk in catastrophe mode
 void dysk_catastrophe(dysk *d);
@@ -80,8 +136,117 @@ struct dysk_def {
   int minor;
 
   int is_vhd; // maintained only to allow get/list cli functions without having to go to the cloud
+
+  // worker scheduling weight (relative to other dysks)
+  unsigned int weight;
+
+  // target request latency in ms (0 for best effort)
+  unsigned int latency_target_ms;
+
+  // submitter polls for responses up to this many us (0 interrupt driven)
+  unsigned int poll_us;
+
+  // storage endpoint port (emulators listen on other than 80)
+  unsigned int port;
+
+  // transport (DYSK_XFER_*)
+  unsigned int transport;
 };
 
+// Transport entry points, d->xfer_state belongs to the transport
+struct dysk_xfer {
+  const char *name;
+  int (*init_for_dysk)(dysk *d);
+  void (*teardown_for_dysk)(dysk *d);
+  // span: one write, or up to DYSK_SPAN_MAX reads in ascending order
+  // (gaps allowed). returns 0 once the span is owned by the transport.
+  // last: nothing was queued behind the span when it was taken
+  int (*do_request)(dysk *d, struct request **span, int span_count, int last);
+  // optional, transports without connections leave it NULL
+  void (*connection_stats)(dysk *d, unsigned int *live, unsigned int *peak);
+};
+
+// Dysks are served by worker in deficit round robin. Every
+// round a dysk earns credit (bytes) proportional to its weight
+// and can only start new requests as long as it has credit.
+// Within a dysk, credit goes to priority lanes in order.
+struct dysk_runq {
+  // tasks queued for this dysk, per lane (linked list heads)
+  struct list_head lanes[DYSK_LANES];
+  // rounds each lane had requests waiting for credit
+  unsigned int starved[DYSK_LANES];
+  // scheduling weight
+  unsigned int weight;
+  // available credit in bytes
+  long deficit;
+  // earliest deadline of requests waiting to start (0 for none)
+  unsigned long next_deadline;
+  // worker is asked to drop this queue once it is empty
+  int detach;
+  // queue is on worker list of queues
+  int attached;
+  // tasks of this dysk in worker's send stage
+  atomic_t tx_tasks;
+  // of which no_throttle (served while dysk is throttled)
+  atomic_t no_throttle_tasks;
+  // submitters in run_w_task (tasks running inline, not on any stage)
+  atomic_t inline_tasks;
+  // tasks of this dysk in worker's receive stage
+  atomic_t rx_tasks;
+  // Linked list pluming (worker's queues)
+  struct list_head list;
+};
+
+// indexed by rq_data_dir() where per op
+struct dysk_stats {
+  u64 ops[2];
+  u64 bytes[2];
+  u64 errors[2];
+  u64 latency[2][DYSK_LAT_BUCKETS];
+  u64 resends;        // request re-sent from the top (retry_new_request)
+  u64 conn_failures;  // connections dropped while sending or receiving
+  u64 throttles;      // times dysk entered throttling
+  u64 throttled_ms;   // time spent throttled
+  u64 timeouts;       // requests failed because they expired
+};
+
+// updated under queue lock, halved every heatmap_half_life_secs
+struct dysk_heat_region {
+  u64 reads;
+  u64 writes;
+  u64 bytes;
+};
+
+// i/o trace file (debugfs) is a dysk_trace_hdr followed by
+// records oldest first. Layout is shared with dyskctl replay
+#define DYSK_TRACE_MAGIC   0x43525444 // "DTRC"
+#define DYSK_TRACE_VERSION 1
+
+#define DYSK_TRACE_WRITE (1 << 0)
+#define DYSK_TRACE_SYNC  (1 << 1)
+#define DYSK_TRACE_FUA   (1 << 2)
+#define DYSK_TRACE_META  (1 << 3)
+
+struct dysk_trace_hdr {
+  u32 magic;
+  u16 version;
+  u16 record_size;
+  u32 count;    // records in file
+  u32 capacity; // ring size
+  u64 recorded; // since trace start, recorded - count were overwritten
+} __packed;
+
+// written under queue lock
+struct dysk_trace_rec {
+  u64 sector;
+  u32 bytes;
+  u32 delta_us; // since previous request (saturates)
+  u32 flags;    // DYSK_TRACE_*
+  u32 seq;      // low bits of record number, gaps are overwritten records
+} __packed;
+
+#define dysk_stat_add(d, field, val) this_cpu_add((d)->stats->field, (val))
+#define dysk_stat_inc(d, field) this_cpu_inc((d)->stats->field)
 
 struct dysk {
   // active/deleting/catastrophe
@@ -92,6 +257,20 @@ struct dysk {
 
   // dysk throttling
   unsigned long throttle_until;
+  unsigned long throttled_on;
+
+  // latency target (jiffies), 0 for best effort
+  unsigned long latency_target;
+
+  // requests accepted and not yet completed
+  atomic_t pending_reqs;
+
+  // smoothed request latency (jiffies, fixed point << 3)
+  unsigned long latency_ewma;
+
+  // dispatched and not yet completed (in-flight budget)
+  atomic64_t inflight_bytes;
+  atomic_t inflight_reqs;
 
   // i/o queue
   spinlock_t lock;
@@ -105,13 +284,38 @@ struct dysk {
   // working serving this dysk
   dysk_worker *worker;
 
-  // state used by the transfer logic
+  // tasks queued on worker for this dysk
+  dysk_runq runq;
+
+  // transport serving this dysk and its state
+  const dysk_xfer *xfer;
   void *xfer_state;
 
+  // i/o counters, summed on read (sysfs)
+  dysk_stats __percpu *stats;
+
+  // debugfs dir of this dysk (dysk/<name>)
+  struct dentry *debugfs;
+
+  // access heat map, NULL if off
+  dysk_heat_region *heat;
+  unsigned int heat_regions;
+  u64 heat_region_sectors;
+  unsigned long heat_decayed_on;
+
+  // i/o trace ring, NULL if off
+  dysk_trace_rec *trace;
+  unsigned int trace_entries;
+  u64 trace_recorded;
+  u64 trace_last_ns;
+
   // Linked list pluming
   struct list_head list;
 };
 
+// module debugfs dir (dysk), workers and dysks add their files there
+extern struct dentry *dysk_debugfs;
+
 // -------------------------------
 // Worker details
 // -------------------------------
@@ -126,12 +330,30 @@ typedef task_result(*w_task_exec_fn)(w_task *this_task);
 // Task clean up
 typedef void(*w_task_state_clean_fn)(w_task *this_task, task_clean_reason clean_reason); // General cleaning function is used when queued with clean=null
 
-//enqueues a new task in worker queue
-int queue_w_task(w_task *parent_task, dysk *d, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state);
+//enqueues a new task in worker queue, req (if any) is the block request served by this task
+int queue_w_task(w_task *parent_task, dysk *d, struct request *req, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state);
+int queue_w_rx_task(w_task *parent_task, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, void *state);
+// poll: caller may busy poll for the task (polled dysks only)
+int run_w_task(dysk *d, struct request *req, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state, int poll);
+// Adds a dysk's queue to worker
+void dysk_worker_attach(dysk_worker *dw, dysk *d, unsigned int weight);
+// Asks worker to drop dysk's queue, returns 1 once queue is no longer served
+int dysk_worker_detach(dysk_worker *dw, dysk *d);
+// charges request against dysk's and module wide in-flight caps (count and
+// bytes), returns 0 with nothing charged if request must wait in queue
+int dysk_budget_charge(dysk *d, struct request *req);
+// accounts a completed block request, start_ns is when it was accepted
+void dysk_stats_request_done(dysk *d, struct request *req, u64 start_ns, int err);
+// gives back what dysk_budget_charge took, once request completes or is requeued
+void dysk_budget_release(dysk *d, struct request *req);
+task_result w_task_retry_after(w_task *this_task, unsigned long delay);
+int dysk_worker_admit(dysk *d);
+// called once the block request served by this task is completed
+void dysk_worker_request_done(w_task *this_task, int err);
 // TODO: Do we need this?
 void dysk_worker_work_available(dysk_worker *dw);
 // Start worker
-int dysk_worker_init(dysk_worker *dw);
+int dysk_worker_init(dysk_worker *dw, int node);
 // Stop worker
 void dysk_worker_teardown(dysk_worker *dw);
 
@@ -149,27 +371,72 @@ enum task_result {
   retry_now     = 1 << 1, // Task will be retried immediatly
   retry_later   = 1 << 2, // Task will be retried next worker round
   throttle_dysk = 1 << 3, // dysk attached to this task will be throttled (affects all tasks related this dysk)
-  catastrophe   = 1 << 4 // dysk failed. dysk failure routine will kick off
+  catastrophe   = 1 << 4, // dysk failed. dysk failure routine will kick off
+  retry_delayed = 1 << 5  // Task will be retried once its delay is over (see w_task_retry_after)
 };
 enum task_mode {
   normal      = 1 << 0, // Task will be throttled when dysk is throttled
   no_throttle = 1 << 1 // task will not be throttled  when dysk is throttled
 };
 
+// worker stages
+#define W_STAGE_SEND 0
+#define W_STAGE_RECEIVE 1
+#define W_STAGES 2
+
+// written only by the stage thread, read racy (debugfs)
+struct w_stage_prof {
+  u64 passes;          // passes over the task lists
+  u64 pass_ns;         // time spent in passes
+  u64 max_pass_ns;
+  u64 visited;         // tasks executed
+  u64 progressed;      // tasks that completed, parked or failed
+  u64 retry_later;     // tasks that asked to be retried next pass
+  u64 sleeps;
+  u64 sleep_ns;
+  u64 queue_len_sum;   // tasks queued at end of each pass
+  unsigned int queue_len;
+  unsigned int max_queue_len;
+  unsigned long oldest_queued_on; // oldest task seen last pass (jiffies), 0 if none
+  // current pass
+  u64 pass_start;
+  unsigned long pass_oldest;
+};
+
 // Dysk work
 struct dysk_worker {
-  // w_task (linked list head)
-  w_task *head;
+  // dysk_runq (linked list head)
+  struct list_head runqs;
   // Keep working, signal used to stop
   int working;
   // Number of tasks in queue
   atomic_t count_tasks;
+  // Number of tasks waiting on their retry timer
+  atomic_t count_parked;
   // Number of throtlled (waiting) tasks in queue
   int count_throttled_tasks;
-  // Lock used for add/delete tasks to the queue
+  // Lock used for add/delete dysk queues
   spinlock_t lock;
-  // Worker thread
+  // send stage: tasks submitted by anyone (lock free)
+  struct llist_head submissions;
+  // Worker thread (send stage)
   struct task_struct *worker_thread;
+  // receive stage: tasks handed off by anyone (lock free)
+  struct llist_head rx_handoff;
+  // receive stage: tasks owned by receive thread
+  struct list_head rx_tasks;
+  // receive stage: # of tasks
+  atomic_t count_rx_tasks;
+  // receive stage: keep working
+  int rx_working;
+  // receive stage thread
+  struct task_struct *rx_thread;
+  // numa node this worker runs on, tasks are allocated there
+  int node;
+  // dysks served by this worker
+  unsigned int count_dysks;
+  // slab names must be unique per worker
+  char slab_name[32];
   /*
   if super dysks (dysks with dedicated worker,
   or smaller # of dysks share worker) ever became
@@ -177,12 +444,22 @@ struct dysk_worker {
   and shared across all workers
   */
   struct kmem_cache *tasks_slab;
+  // recently freed tasks, per cpu
+  struct w_task_cache __percpu *task_cache;
+  // send and receive stage profiles
+  w_stage_prof prof[W_STAGES];
+  // debugfs file of this worker
+  struct dentry *debugfs;
 };
 
 // worker task -- linked list
 struct w_task {
   // Expires on (jiffies)
   unsigned long expires_on;
+  // request queued on (jiffies)
+  unsigned long queued_on;
+  // should start by (jiffies), 0 for best effort
+  unsigned long deadline;
   // Task mode as defined below
   task_mode mode;
   // Function to execution
@@ -194,6 +471,30 @@ struct w_task {
   void *state;
   // Dysk
   dysk *d;
+  // block request served by this task (if any)
+  struct request *req;
+  // bytes charged against dysk's credit when task starts
+  size_t cost;
+  // task (or its parent) was charged
+  int charged;
+  // priority lane
+  int lane;
+  // executing in submitter's context, not in worker
+  int inline_exec;
+  // submitter busy polls for it (last request of a batch on a polled dysk)
+  int inline_poll;
+  // task queued by an inline polled task, caller runs it
+  w_task *inline_next;
+  // throttle/catastrophe reached inline, applied by worker (0 for none)
+  task_result outcome;
+  // runs in receive stage
+  int rx;
+  // submission/handoff to a worker stage
+  struct llist_node handoff;
+  // delayed retry, not executed before (jiffies)
+  unsigned long not_before;
+  // fires when delay is over
+  struct timer_list timer;
   // Linked list pluming
   struct list_head list;
 };
@@ -0,0 +1,160 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dysk
+
+#if !defined(_DYSK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DYSK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blkdev.h>
+
+#include "dysk_bdd.h"
+
+/*
+ Request lifecycle, in order:
+ accept -> queue -> conn -> header_sent -> body_sent (writes)
+ -> first_byte -> response -> complete
+ decision is emitted whenever a request is retried, throttled or fails.
+ attempt is 0 for the first try and grows each time the request is re-sent.
+*/
+DECLARE_EVENT_CLASS(dysk_rq,
+  TP_PROTO(dysk *d, struct request *req, int attempt),
+  TP_ARGS(d, req, attempt),
+  TP_STRUCT__entry(
+    __string(name,         d->def->deviceName)
+    __field(sector_t,      sector)
+    __field(unsigned int,  bytes)
+    __field(int,           rw)
+    __field(int,           attempt)
+  ),
+  TP_fast_assign(
+    __assign_str(name,     d->def->deviceName);
+    __entry->sector      = blk_rq_pos(req);
+    __entry->bytes       = blk_rq_bytes(req);
+    __entry->rw          = rq_data_dir(req);
+    __entry->attempt     = attempt;
+  ),
+  TP_printk("%s %c %llu + %u attempt %d", __get_str(name), __entry->rw ? 'W' : 'R',
+            (unsigned long long) __entry->sector, __entry->bytes, __entry->attempt)
+);
+
+// request taken off block layer queue
+DEFINE_EVENT(dysk_rq, dysk_rq_accept,
+  TP_PROTO(dysk *d, struct request *req, int attempt),
+  TP_ARGS(d, req, attempt)
+);
+
+// send task queued (or run inline) for the request
+DEFINE_EVENT(dysk_rq, dysk_rq_queue,
+  TP_PROTO(dysk *d, struct request *req, int attempt),
+  TP_ARGS(d, req, attempt)
+);
+
+DEFINE_EVENT(dysk_rq, dysk_rq_header_sent,
+  TP_PROTO(dysk *d, struct request *req, int attempt),
+  TP_ARGS(d, req, attempt)
+);
+
+DEFINE_EVENT(dysk_rq, dysk_rq_body_sent,
+  TP_PROTO(dysk *d, struct request *req, int attempt),
+  TP_ARGS(d, req, attempt)
+);
+
+DEFINE_EVENT(dysk_rq, dysk_rq_first_byte,
+  TP_PROTO(dysk *d, struct request *req, int attempt),
+  TP_ARGS(d, req, attempt)
+);
+
+// connection checked out of the pool, created is 1 for a new socket
+TRACE_EVENT(dysk_rq_conn,
+  TP_PROTO(dysk *d, struct request *req, int attempt, int created),
+  TP_ARGS(d, req, attempt, created),
+  TP_STRUCT__entry(
+    __string(name,         d->def->deviceName)
+    __field(sector_t,      sector)
+    __field(unsigned int,  bytes)
+    __field(int,           attempt)
+    __field(int,           created)
+  ),
+  TP_fast_assign(
+    __assign_str(name,     d->def->deviceName);
+    __entry->sector      = blk_rq_pos(req);
+    __entry->bytes       = blk_rq_bytes(req);
+    __entry->attempt     = attempt;
+    __entry->created     = created;
+  ),
+  TP_printk("%s %llu + %u attempt %d %s", __get_str(name), (unsigned long long) __entry->sector,
+            __entry->bytes, __entry->attempt, __entry->created ? "created" : "reused")
+);
+
+// full response received
+TRACE_EVENT(dysk_rq_response,
+  TP_PROTO(dysk *d, struct request *req, int attempt, int status),
+  TP_ARGS(d, req, attempt, status),
+  TP_STRUCT__entry(
+    __string(name,         d->def->deviceName)
+    __field(sector_t,      sector)
+    __field(unsigned int,  bytes)
+    __field(int,           attempt)
+    __field(int,           status)
+  ),
+  TP_fast_assign(
+    __assign_str(name,     d->def->deviceName);
+    __entry->sector      = blk_rq_pos(req);
+    __entry->bytes       = blk_rq_bytes(req);
+    __entry->attempt     = attempt;
+    __entry->status      = status;
+  ),
+  TP_printk("%s %llu + %u attempt %d status %d", __get_str(name), (unsigned long long) __entry->sector,
+            __entry->bytes, __entry->attempt, __entry->status)
+);
+
+// request is re-sent, throttled or failed (resend, throttle, catastrophe)
+TRACE_EVENT(dysk_rq_decision,
+  TP_PROTO(dysk *d, struct request *req, int attempt, const char *decision),
+  TP_ARGS(d, req, attempt, decision),
+  TP_STRUCT__entry(
+    __string(name,         d->def->deviceName)
+    __field(sector_t,      sector)
+    __field(unsigned int,  bytes)
+    __field(int,           attempt)
+    __string(decision,     decision)
+  ),
+  TP_fast_assign(
+    __assign_str(name,     d->def->deviceName);
+    __entry->sector      = blk_rq_pos(req);
+    __entry->bytes       = blk_rq_bytes(req);
+    __entry->attempt     = attempt;
+    __assign_str(decision, decision);
+  ),
+  TP_printk("%s %llu + %u attempt %d %s", __get_str(name), (unsigned long long) __entry->sector,
+            __entry->bytes, __entry->attempt, __get_str(decision))
+);
+
+// request completed to block layer
+TRACE_EVENT(dysk_rq_complete,
+  TP_PROTO(dysk *d, struct request *req, int err),
+  TP_ARGS(d, req, err),
+  TP_STRUCT__entry(
+    __string(name,         d->def->deviceName)
+    __field(sector_t,      sector)
+    __field(unsigned int,  bytes)
+    __field(int,           err)
+  ),
+  TP_fast_assign(
+    __assign_str(name,     d->def->deviceName);
+    __entry->sector      = blk_rq_pos(req);
+    __entry->bytes       = blk_rq_bytes(req);
+    __entry->err         = err;
+  ),
+  TP_printk("%s %llu + %u err %d", __get_str(name), (unsigned long long) __entry->sector,
+            __entry->bytes, __entry->err)
+);
+
+#endif // _DYSK_TRACE_H
+
+// must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dysk_trace
+#include <trace/define_trace.h>
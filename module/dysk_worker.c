@@ -2,6 +2,17 @@
 #include <linux/list.h>
 #include <linux/kthread.h>
 #include <linux/jiffies.h>
+#include <linux/ioprio.h>
+#include <linux/list_sort.h>
+#include <linux/topology.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/mm.h>
+#endif
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
 
 #include "dysk_bdd.h"
 /*
@@ -19,18 +30,69 @@ retry_later: task will be executed again in next worker round.
 throttle: puts the dysk linked to the task in throttle mode.
 catastrophe: puts the dysk in catastrophe mode.
 
+retry_delayed: task will be executed again once its delay is over.
+
 in addition to throttling the worker also manages the timeout
 (expiration)for tasks.
 
+Tasks that wait (delayed retries) are taken off dysk queues and parked
+on a kernel timer until their delay or expiry, whichever comes first.
+Dysks in throttle mode are skipped as a whole. A worker round only
+visits tasks that can make progress.
+
 Finally when a dysk is deleted or in catastrophe mode the worker
 does not execute linked tasks instead calls the clean up routines.
 
+Tasks are queued per dysk. The worker serves dysks in deficit round
+robin: every round a dysk earns (quantum * weight) bytes of credit,
+a task serving a block request is charged the request size once, when
+it is first executed. A dysk out of credit does not start new requests
+until next round, but its in-flight work is still served.
+That keeps a dysk with large queued writes from starving the others.
+
+Within a dysk tasks are split in priority lanes based on the request
+i/o priority class and flags. Realtime and synchronous requests get
+credit (and hence connections) ahead of background writeback. A lane
+that waited for credit for DYSK_LANE_MAX_STARVE rounds is served first.
+
+Dysks mounted with a latency target tag their requests with a deadline.
+Every round dysks are served earliest deadline first, best effort dysks
+go last. Dysks that are already missing their deadlines (or expect to)
+stop taking new requests from the block layer until they catch up.
+
+There is one worker per numa node, bound to the node's cpus. A dysk
+is served by one worker, tasks and request state are allocated on that
+worker's node.
+
+Tasks are submitted to a worker on a lock free list, the worker splices
+them into dysk queues (that only it touches) at the start of every
+round. Tasks are allocated from small per cpu caches, worker and
+submitters don't contend on a lock or on the slab.
+
+Each worker is a pipeline of two threads. The send stage serves dysk
+queues as described above. Tasks that wait for responses are handed off
+(lock free) to the receive stage, which runs them on its own thread.
+Responses sitting in socket buffers don't wait behind large sends, and
+receive tasks (already charged) are not subject to dysk credit.
+
+Each stage accounts its own time (passes, tasks visited vs. tasks
+that made progress, retries, sleep, queue length and oldest task age)
+in /sys/kernel/debug/dysk/worker-<node>.
+
 all tasks are expected to be non-blocking mode.
 */
 
 #define W_TASK_TIMEOUT jiffies + (300 * HZ)
 #define DYSK_THROTTLE_DEFAULT jiffies + (HZ / 10)
-#define WORKER_SLAB_NAME "dysk_worker_tasks"
+#define WORKER_SLAB_NAME "dysk_worker_tasks_%d"
+#define DYSK_DRR_QUANTUM (512 * 1024) // bytes per round at default weight
+#define DYSK_ADMIT_MIN_DEPTH 4        // dysk is always allowed to have this many requests
+#define W_TASK_CACHE_SIZE 16          // free tasks kept per cpu
+
+struct w_task_cache {
+  unsigned int count;
+  w_task *tasks[W_TASK_CACHE_SIZE];
+};
 // Default clean up function for state, we use kfree
 void default_w_task_state_clean(w_task *this_task, task_clean_reason clean_reason)
 {
@@ -40,30 +102,431 @@ void default_w_task_state_clean(w_task *this_task, task_clean_reason clean_reaso
   }
 }
 
-int queue_w_task(w_task *parent_task, dysk *d, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state)
+// Maps a block request to a priority lane
+static int task_lane(struct request *req)
+{
+  int ioprio_class;
+
+  // worker control tasks
+  if (!req) return DYSK_LANE_RT;
+
+  ioprio_class = IOPRIO_PRIO_CLASS(req_get_ioprio(req));
+
+  if (IOPRIO_CLASS_RT == ioprio_class || (req->cmd_flags & REQ_META)) return DYSK_LANE_RT;
+
+  if (IOPRIO_CLASS_IDLE == ioprio_class) return DYSK_LANE_ASYNC;
+
+  // reads are sync, writes are sync only if flagged
+  if (rq_is_sync(req)) return DYSK_LANE_SYNC;
+
+  return DYSK_LANE_ASYNC;
+}
+
+// gets a task from this cpu cache, or from the slab
+static w_task *alloc_task(dysk_worker *dw)
+{
+  struct w_task_cache *cache;
+  w_task *w = NULL;
+  cache = get_cpu_ptr(dw->task_cache);
+
+  if (0 != cache->count) w = cache->tasks[--cache->count];
+
+  put_cpu_ptr(dw->task_cache);
+
+  if (!w) w = kmem_cache_alloc_node(dw->tasks_slab, GFP_NOIO, dw->node);
+
+  return w;
+}
+
+// keeps a task in this cpu cache, or returns it to the slab
+static void free_task(dysk_worker *dw, w_task *w)
+{
+  struct w_task_cache *cache;
+  cache = get_cpu_ptr(dw->task_cache);
+
+  if (W_TASK_CACHE_SIZE > cache->count) {
+    cache->tasks[cache->count++] = w;
+    w = NULL;
+  }
+
+  put_cpu_ptr(dw->task_cache);
+
+  if (w) kmem_cache_free(dw->tasks_slab, w);
+}
+
+static void unpark_w_task(w_task *w)
+{
+  dysk_worker *dw = w->d->worker;
+  atomic_dec(&dw->count_parked);
+  llist_add(&w->handoff, &dw->submissions);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+static void w_task_timer_fn(struct timer_list *t)
+{
+  w_task *w = from_timer(w, t, timer);
+  unpark_w_task(w);
+}
+#else
+static void w_task_timer_fn(unsigned long data)
+{
+  unpark_w_task((w_task *) data);
+}
+#endif
+
+// takes a task off its dysk queue until its delay is over
+static void park_w_task(dysk_worker *dw, w_task *w)
+{
+  unsigned long until = w->not_before;
+
+  // expiry is checked once it is back
+  if (time_after(until, w->expires_on)) until = w->expires_on;
+
+  list_del(&w->list);
+  atomic_inc(&dw->count_parked);
+  mod_timer(&w->timer, until);
+}
+
+task_result w_task_retry_after(w_task *this_task, unsigned long delay)
+{
+  this_task->not_before = jiffies + (delay ? delay : 1);
+  return retry_delayed;
+}
+
+// allocates a task, it is not visible to worker until dispatched
+static w_task *new_w_task(w_task *parent_task, dysk *d, struct request *req, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state)
 {
   w_task *w       = NULL;
   dysk_worker *dw = NULL;
   dw = d->worker;
-  w = kmem_cache_alloc(dw->tasks_slab, GFP_NOIO);
+  w = alloc_task(dw);
 
-  if (!w) return -ENOMEM;
+  if (!w) return NULL;
 
   memset(w, 0, sizeof(w_task));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+  timer_setup(&w->timer, w_task_timer_fn, 0);
+#else
+  setup_timer(&w->timer, w_task_timer_fn, (unsigned long) w);
+#endif
   w->mode       = mode;
   w->state      = state;
   w->clean_fn   = (NULL != state_clean_fn) ?  state_clean_fn : &default_w_task_state_clean;
   w->exec_fn    = exec_fn;
   w->d          = d;
   w->expires_on = (NULL != parent_task) ? parent_task->expires_on : W_TASK_TIMEOUT;
-  // add it to the queue
-  spin_lock(&dw->lock);
-  list_add_tail(&w->list, &dw->head->list);
-  spin_unlock(&dw->lock);
+  w->req        = (NULL != parent_task && NULL == req) ? parent_task->req : req;
+  w->cost       = (NULL != w->req) ? blk_rq_bytes(w->req) : 0;
+  // child tasks carry on the work their parent was charged for
+  w->charged    = (NULL != parent_task) ? parent_task->charged : 0;
+  w->lane       = (NULL != parent_task) ? parent_task->lane : task_lane(w->req);
+  w->queued_on  = (NULL != parent_task) ? parent_task->queued_on : jiffies;
+
+  if (NULL != parent_task)
+    w->deadline = parent_task->deadline;
+  else if (NULL != w->req && 0 != d->latency_target)
+    w->deadline = jiffies + d->latency_target;
+
+  // a new request is accepted
+  if (NULL == parent_task && NULL != w->req) atomic_inc(&d->pending_reqs);
+
+  return w;
+}
+
+// adds task to its dysk queue, or hands it to receive stage
+static void dispatch_w_task(dysk_worker *dw, w_task *w)
+{
+  dysk *d = w->d;
+
+  if (1 == w->rx) {
+    atomic_inc(&d->runq.rx_tasks);
+    atomic_inc(&dw->count_rx_tasks);
+    llist_add(&w->handoff, &dw->rx_handoff);
+    return;
+  }
+
   // Increase # of tasks
-  atomic_inc(&d->worker->count_tasks);
+  atomic_inc(&d->runq.tx_tasks);
+  atomic_inc(&dw->count_tasks);
+
+  if (no_throttle == w->mode) atomic_inc(&d->runq.no_throttle_tasks);
+
+  // worker adds it to dysk queue on its next round
+  llist_add(&w->handoff, &dw->submissions);
+}
+
+// moves submitted tasks to their dysk queues, in submission order
+static void splice_submissions(dysk_worker *dw)
+{
+  struct llist_node *batch;
+  w_task *w, *next;
+  dysk_runq *rq;
+  batch = llist_reverse_order(llist_del_all(&dw->submissions));
+  llist_for_each_entry_safe(w, next, batch, handoff) {
+    rq = &w->d->runq;
+    list_add_tail(&w->list, &rq->lanes[w->lane]);
+
+    if (0 == w->charged && 0 != w->deadline &&
+        (0 == rq->next_deadline || time_before(w->deadline, rq->next_deadline)))
+      rq->next_deadline = w->deadline;
+  }
+}
+
+static void submit_w_task(w_task *parent_task, w_task *w)
+{
+  // polled tasks: follow up stays with the submitter
+  if (NULL != parent_task && 1 == parent_task->inline_exec &&
+      1 == parent_task->inline_poll && NULL == parent_task->inline_next) {
+    w->inline_exec = 1;
+    w->inline_poll = 1;
+    parent_task->inline_next = w;
+    return;
+  }
+
+  dispatch_w_task(w->d->worker, w);
+}
+
+int queue_w_task(w_task *parent_task, dysk *d, struct request *req, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state)
+{
+  w_task *w = new_w_task(parent_task, d, req, exec_fn, state_clean_fn, mode, state);
+
+  if (!w) return -ENOMEM;
+
+  submit_w_task(parent_task, w);
+  return 0;
+}
+
+// queues a follow up task on receive stage, it is never throttled
+int queue_w_rx_task(w_task *parent_task, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, void *state)
+{
+  w_task *w = new_w_task(parent_task, parent_task->d, NULL, exec_fn, state_clean_fn, no_throttle, state);
+
+  if (!w) return -ENOMEM;
+
+  w->rx = 1;
+  submit_w_task(parent_task, w);
+  return 0;
+}
+
+// send and receive stages both throttle, only one of them
+// enters (or exits) a throttle period
+static void throttle_enter(dysk *d)
+{
+  if (0 != cmpxchg(&d->throttle_until, 0, DYSK_THROTTLE_DEFAULT)) return;
+
+  d->throttled_on = jiffies;
+  dysk_stat_inc(d, throttles);
+  printk(KERN_INFO "dysk: %s is entering throttling mode", d->def->deviceName);
+}
+
+static void throttle_exit(dysk *d)
+{
+  unsigned long until = READ_ONCE(d->throttle_until);
+
+  // only the throttle period that was seen expiring is ended
+  if (0 == until || !time_after(jiffies, until)) return;
+
+  if (until != cmpxchg(&d->throttle_until, until, 0)) return;
+
+  printk(KERN_INFO "dysk: %s throttling is completed", d->def->deviceName);
+  dysk_stat_add(d, throttled_ms, jiffies_to_msecs(jiffies - d->throttled_on));
+}
+
+// executes a task once in submitter's context, returns 1 if the task completed.
+// Throttling and catastrophe (which deletes the disk) are not done from the
+// queue's own request_fn, the task carries them to worker (w->outcome)
+static int execute_inline(dysk_worker *dw, w_task *w, w_task **next)
+{
+  task_result res = w->exec_fn(w);
+
+  switch (res) {
+    case retry_now:
+    case retry_later:
+    case retry_delayed:
+      return 0;
+
+    case throttle_dysk:
+    case catastrophe:
+      w->outcome = res;
+      return 0;
+
+    case done:
+      break;
+  }
+
+  *next = w->inline_next;
+  w->clean_fn(w, clean_done);
+  free_task(dw, w);
+  return 1;
+}
+
+/*
+ Executes a new task once in caller's context, saving a trip through
+ the worker. Only done when the dysk has nothing queued (it is lightly
+ loaded, nothing it could overtake), the task is not charged against
+ dysk's credit. If the task does not complete it is queued on worker
+ and resumed from where it stopped. Callers that can not sleep (or
+ run with interrupts off) get their task queued on worker instead.
+ Allocations made inline are GFP_NOIO (memalloc_noio_save) since the
+ caller can be writeback or reclaim.
+
+ Polled dysks go further, tasks queued by the inline task (receiving
+ the response) are executed by the caller in a busy loop for up to
+ poll_us, the worker and its wake ups are out of the request path.
+ Whatever is not done by then is handed to worker. Only the last
+ request of a batch is polled for, earlier ones are sent and handed
+ off so the batch is not served one request at a time.
+*/
+// can the caller run a task inline (it may sleep)
+static int can_run_inline(void)
+{
+  if (in_interrupt() || irqs_disabled()) return 0;
+
+#ifdef CONFIG_PREEMPT_COUNT
+  if (!preemptible()) return 0;
+#endif
+  return 1;
+}
+
+int run_w_task(dysk *d, struct request *req, w_task_exec_fn exec_fn, w_task_state_clean_fn state_clean_fn, task_mode mode, void *state, int poll)
+{
+  dysk_worker *dw = d->worker;
+  w_task *next    = NULL;
+  w_task *w       = NULL;
+  s64 poll_until;
+  unsigned int noio_flags;
+
+  // dysk can not be reaped (and its transport torn down) while its
+  // tasks run here, off worker stages. Paired with dysk_worker_detach()
+  atomic_inc(&d->runq.inline_tasks);
+  smp_mb__after_atomic();
+
+  if (DYSK_OK != d->status) {
+    atomic_dec(&d->runq.inline_tasks);
+    return -ENODEV;
+  }
+
+  w = new_w_task(NULL, d, req, exec_fn, state_clean_fn, mode, state);
+
+  if (!w) {
+    atomic_dec(&d->runq.inline_tasks);
+    return -ENOMEM;
+  }
+
+  if (0 != d->throttle_until || 0 == can_run_inline() || 0 != atomic_read(&d->runq.tx_tasks)) goto dispatch;
+
+  w->charged     = 1;
+  w->inline_exec = 1;
+  w->inline_poll = (0 != poll && 0 != d->def->poll_us);
+  poll_until     = ktime_to_ns(ktime_get()) + (s64) d->def->poll_us * NSEC_PER_USEC;
+  noio_flags     = memalloc_noio_save();
+
+  while (1) {
+    next = NULL;
+
+    if (1 == execute_inline(dw, w, &next)) {
+      if (!next) {
+        memalloc_noio_restore(noio_flags);
+        atomic_dec(&d->runq.inline_tasks);
+        return 0;
+      }
+
+      w = next;
+      continue;
+    }
+
+    // polled dysks keep trying until their time is up
+    if (0 == w->inline_poll || DYSK_OK != d->status || 0 != w->outcome ||
+        ktime_to_ns(ktime_get()) >= poll_until || need_resched())
+      break;
+
+    cpu_relax();
+  }
+
+  memalloc_noio_restore(noio_flags);
+
+  // task did not complete, worker takes it (and anything it queued) from here
+  if (w->inline_next) {
+    w->inline_next->inline_exec = 0;
+    w->inline_next->inline_poll = 0;
+    dispatch_w_task(dw, w->inline_next);
+    w->inline_next = NULL;
+  }
+
+  w->inline_exec = 0;
+  w->inline_poll = 0;
+dispatch:
+  dispatch_w_task(dw, w);
+  // counted on worker stages from here
+  atomic_dec(&d->runq.inline_tasks);
   return 0;
 }
+// can dysk accept a new request and still meet its latency target
+int dysk_worker_admit(dysk *d)
+{
+  unsigned long next_deadline = d->runq.next_deadline;
+  int pending = atomic_read(&d->pending_reqs);
+
+  if (0 == d->latency_target || DYSK_ADMIT_MIN_DEPTH > pending) return 1;
+
+  // requests waiting to start already missed their deadline
+  if (0 != next_deadline && time_after(jiffies, next_deadline)) return 0;
+
+  // requests complete slower than the target
+  if ((d->latency_ewma >> 3) > d->latency_target) return 0;
+
+  return 1;
+}
+
+// block request served by this task is completed
+void dysk_worker_request_done(w_task *this_task, int err)
+{
+  dysk *d = this_task->d;
+  long latency;
+  atomic_dec(&d->pending_reqs);
+
+  if (0 != err) return;
+
+  // ewma with 1/8 weight for the new sample
+  latency = (long) (jiffies - this_task->queued_on) << 3;
+  d->latency_ewma = d->latency_ewma + ((latency - (long) d->latency_ewma) >> 3);
+}
+
+// Adds dysk's queue to worker
+void dysk_worker_attach(dysk_worker *dw, dysk *d, unsigned int weight)
+{
+  dysk_runq *rq = &d->runq;
+  int lane;
+
+  for (lane = 0; lane < DYSK_LANES; lane++) {
+    INIT_LIST_HEAD(&rq->lanes[lane]);
+    rq->starved[lane] = 0;
+  }
+
+  rq->weight   = weight;
+  rq->deficit  = 0;
+  rq->next_deadline = 0;
+  rq->detach   = 0;
+  rq->attached = 1;
+  atomic_set(&rq->tx_tasks, 0);
+  atomic_set(&rq->no_throttle_tasks, 0);
+  atomic_set(&rq->inline_tasks, 0);
+  atomic_set(&rq->rx_tasks, 0);
+  spin_lock(&dw->lock);
+  list_add_tail(&rq->list, &dw->runqs);
+  dw->count_dysks++;
+  spin_unlock(&dw->lock);
+}
+
+// Worker drops the queue on its next round (once empty)
+int dysk_worker_detach(dysk_worker *dw, dysk *d)
+{
+  d->runq.detach = 1;
+  // dysk status (set before) is seen by run_w_task, or its count is seen here
+  smp_mb();
+  return (0 == d->runq.attached) ? 1 : 0;
+}
+
 // -----------------------------
 // Worker Big Loop
 // -----------------------------
@@ -73,11 +536,15 @@ static void execute(dysk_worker *dw, w_task *w)
 {
   // Tasks returning retry_now will be executed to max then retried later.
 #define max_retry_now_count 3 // Max # of retrying a task that said retry now
-  task_result taskresult;
+  task_result taskresult = retry_later;
   task_clean_reason clean_reason = clean_done;
   int execCount     = 0;
+  w_stage_prof *prof = &dw->prof[w->rx ? W_STAGE_RECEIVE : W_STAGE_SEND];
   dysk *d;
   d = w->d;
+  prof->visited++;
+
+  if (0 == prof->pass_oldest || time_before(w->queued_on, prof->pass_oldest)) prof->pass_oldest = w->queued_on;
 
   // if dysk is deleting or catastrophe dequeue
   if (DYSK_OK != w->d->status) {
@@ -88,16 +555,32 @@ static void execute(dysk_worker *dw, w_task *w)
     goto dequeue_task;
   }
 
-  // if dysk was throttled, check if we still need to be
-  if (0 != w->d->throttle_until && time_after(jiffies, w->d->throttle_until)) {
-    printk(KERN_INFO "dysk: %s throttling is completed", d->def->deviceName);
-    d->throttle_until = 0;
+  // task was executed inline, outcome is applied here
+  if (throttle_dysk == w->outcome) {
+    throttle_enter(d);
+    goto dequeue_task;
+  }
+
+  if (catastrophe == w->outcome) {
+    dysk_catastrophe(d);
+    clean_reason = clean_dysk_catastrohpe;
+    goto dequeue_task;
   }
 
+  // if dysk was throttled, check if we still need to be
+  if (0 != w->d->throttle_until && time_after(jiffies, w->d->throttle_until)) throttle_exit(d);
+
   // dysk is throttled only tasks marked with no_throttle will execute
   if (0 != d->throttle_until && no_throttle != w->mode)
     return;
 
+  // has expired? (don't give it one more go)
+  if (time_after(jiffies, w->expires_on)) {
+    printk(KERN_INFO "This task is timing out");
+    clean_reason = clean_timeout;
+    goto dequeue_task;
+  }
+
   while (execCount < max_retry_now_count) {
     execCount++;
     taskresult =  w->exec_fn(w);
@@ -112,12 +595,17 @@ static void execute(dysk_worker *dw, w_task *w)
       case retry_later:
         break;
 
-      case throttle_dysk: {
-        if (0 == d->throttle_until) {
-          d->throttle_until = DYSK_THROTTLE_DEFAULT;
-          printk(KERN_INFO "dysk: %s is entering throttling mode", d->def->deviceName);
-        }
+      case retry_delayed: {
+        // receive stage keeps polling, only send stage parks
+        if (1 == w->rx) break;
+
+        park_w_task(dw, w);
+        prof->progressed++;
+        return;
+      }
 
+      case throttle_dysk: {
+        throttle_enter(d);
         goto dequeue_task;
       }
 
@@ -129,60 +617,347 @@ static void execute(dysk_worker *dw, w_task *w)
     }
   }
 
-  // has expired?
-  if (time_after(jiffies, w->expires_on)) {
-    printk(KERN_INFO "This task is timing out");
-    clean_reason = clean_timeout;
-    goto dequeue_task;
-  }
+  if (retry_later == taskresult) prof->retry_later++;
 
   return;
 dequeue_task:
-  // dequeue
-  spin_lock(&dw->lock);
+  prof->progressed++;
+
+  // receive stage list is private to its thread
+  if (1 == w->rx) {
+    list_del(&w->list);
+    w->clean_fn(w, clean_reason);
+    // dysk can be reaped once its receive tasks are cleaned
+    atomic_dec(&d->runq.rx_tasks);
+    atomic_dec(&dw->count_rx_tasks);
+    free_task(dw, w);
+    return;
+  }
+
+  // dequeue, dysk queues are private to worker
   list_del(&w->list);
-  spin_unlock(&dw->lock);
-  // decrease counter
-  atomic_dec(&dw->count_tasks);
   // clean
   w->clean_fn(w, clean_reason);
+  // decrease counters
+  atomic_dec(&d->runq.tx_tasks);
+  atomic_dec(&dw->count_tasks);
+
+  if (no_throttle == w->mode) atomic_dec(&d->runq.no_throttle_tasks);
+
   // free
-  kmem_cache_free(dw->tasks_slab, w);
+  free_task(dw, w);
+}
+// is there any task queued for this dysk
+static int runq_empty(dysk_runq *rq)
+{
+  int lane;
+
+  for (lane = 0; lane < DYSK_LANES; lane++)
+    if (!list_empty(&rq->lanes[lane])) return 0;
+
+  return 1;
+}
+
+// Executes tasks of a single lane within dysk credit. Once a lane is out
+// of credit, lanes served after it don't start new requests either.
+// returns 1 if tasks in this lane are waiting for credit
+static int serve_lane(dysk_worker *dw, dysk_runq *rq, int lane, int *out_of_credit, unsigned long *next_deadline)
+{
+  w_task *t, *next;
+  int has_pending = 0;
+  list_for_each_entry_safe(t, next, &rq->lanes[lane], list) {
+    if (0 == t->charged && 0 != t->cost) {
+      // keep requests in order, once we are out of credit
+      // no new request starts until next round.
+      if (1 == *out_of_credit || t->cost > rq->deficit) {
+        *out_of_credit = 1;
+        has_pending    = 1;
+
+        if (0 != t->deadline && (0 == *next_deadline || time_before(t->deadline, *next_deadline)))
+          *next_deadline = t->deadline;
+
+        continue;
+      }
+
+      rq->deficit -= t->cost;
+      t->charged   = 1;
+    }
+
+    execute(dw, t);
+  }
+  return has_pending;
+}
+
+// throttled dysk: only no_throttle tasks run, the rest wait without
+// being visited (unless there are no_throttle tasks to look for)
+static void serve_no_throttle(dysk_worker *dw, dysk_runq *rq)
+{
+  w_task *t, *next;
+  int lane;
+
+  if (0 == atomic_read(&rq->no_throttle_tasks)) return;
+
+  for (lane = 0; lane < DYSK_LANES; lane++) {
+    list_for_each_entry_safe(t, next, &rq->lanes[lane], list) {
+      if (no_throttle == t->mode) execute(dw, t);
+    }
+  }
+}
+
+// Executes tasks of a single dysk, within its credit
+static void serve_runq(dysk_worker *dw, dysk_runq *rq)
+{
+  dysk *d = container_of(rq, dysk, runq);
+  int lane;
+  int out_of_credit = 0;
+  int has_pending   = 0;
+  int served[DYSK_LANES] = {0};
+  unsigned long next_deadline = 0;
+
+  if (runq_empty(rq)) {
+    // idle dysks don't accumulate credit
+    rq->deficit = 0;
+    rq->next_deadline = 0;
+    return;
+  }
+
+  // throttled dysk tasks wait, except for no_throttle ones
+  if (DYSK_OK == d->status && 0 != d->throttle_until) {
+    if (!time_after(jiffies, d->throttle_until)) {
+      serve_no_throttle(dw, rq);
+      return;
+    }
+
+    throttle_exit(d);
+  }
+
+  rq->deficit += (DYSK_DRR_QUANTUM / DYSK_DEFAULT_WEIGHT) * rq->weight;
+
+  // starved lanes go first, then the rest in priority order
+  for (lane = 0; lane < DYSK_LANES * 2; lane++) {
+    int l = lane % DYSK_LANES;
+
+    if (1 == served[l]) continue;
+
+    if (lane < DYSK_LANES && DYSK_LANE_MAX_STARVE > rq->starved[l]) continue;
+
+    served[l] = 1;
+
+    if (1 == serve_lane(dw, rq, l, &out_of_credit, &next_deadline)) {
+      rq->starved[l]++;
+      has_pending = 1;
+    } else {
+      rq->starved[l] = 0;
+    }
+  }
+
+  // nothing waiting for credit, don't carry it to next round
+  if (0 == has_pending) rq->deficit = 0;
+
+  rq->next_deadline = next_deadline;
+}
+
+// Orders dysks by earliest deadline, best effort dysks go last
+static int runq_deadline_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+  dysk_runq *rqa = list_entry(a, dysk_runq, list);
+  dysk_runq *rqb = list_entry(b, dysk_runq, list);
+
+  if (rqa->next_deadline == rqb->next_deadline) return 0;
+
+  if (0 == rqa->next_deadline) return 1;
+
+  if (0 == rqb->next_deadline) return -1;
+
+  return time_before(rqa->next_deadline, rqb->next_deadline) ? -1 : 1;
 }
+
+// drops queues marked for detach once they are empty
+// and orders the rest for the next round
+static void reap_runqs(dysk_worker *dw)
+{
+  dysk_runq *rq, *next;
+  int has_deadlines = 0;
+  spin_lock(&dw->lock);
+  list_for_each_entry_safe(rq, next, &dw->runqs, list) {
+    if (1 == rq->detach && 0 == atomic_read(&rq->tx_tasks) && 0 == atomic_read(&rq->rx_tasks) &&
+        0 == atomic_read(&rq->inline_tasks)) {
+      list_del(&rq->list);
+      rq->attached = 0;
+      dw->count_dysks--;
+      continue;
+    }
+
+    if (0 != rq->next_deadline) has_deadlines = 1;
+  }
+
+  // stable, dysks with no deadline keep their order
+  if (1 == has_deadlines) list_sort(NULL, &dw->runqs, runq_deadline_cmp);
+
+  spin_unlock(&dw->lock);
+}
+
+// ---------------------------------
+// Stage profiling
+// ---------------------------------
+static void prof_pass_begin(w_stage_prof *prof)
+{
+  prof->pass_start  = ktime_get_ns();
+  prof->pass_oldest = 0;
+}
+
+static void prof_pass_end(w_stage_prof *prof, unsigned int queue_len)
+{
+  u64 took = ktime_get_ns() - prof->pass_start;
+  prof->passes++;
+  prof->pass_ns += took;
+
+  if (took > prof->max_pass_ns) prof->max_pass_ns = took;
+
+  prof->queue_len = queue_len;
+  prof->queue_len_sum += queue_len;
+
+  if (queue_len > prof->max_queue_len) prof->max_queue_len = queue_len;
+
+  prof->oldest_queued_on = prof->pass_oldest;
+}
+
+// Yield cpu, stage has no work (or all of it is waiting).
+static void stage_sleep(w_stage_prof *prof)
+{
+  u64 start = ktime_get_ns();
+  set_current_state(TASK_INTERRUPTIBLE);
+  schedule_timeout(HZ / 1000);
+  prof->sleeps++;
+  prof->sleep_ns += ktime_get_ns() - start;
+}
+
+static void show_stage(struct seq_file *m, const char *name, w_stage_prof *prof)
+{
+  unsigned long oldest = prof->oldest_queued_on;
+  seq_printf(m, "%s:\n", name);
+  seq_printf(m, "  passes: %llu\n", prof->passes);
+  seq_printf(m, "  pass_ns: %llu\n", prof->pass_ns);
+  seq_printf(m, "  max_pass_ns: %llu\n", prof->max_pass_ns);
+  seq_printf(m, "  visited: %llu\n", prof->visited);
+  seq_printf(m, "  progressed: %llu\n", prof->progressed);
+  seq_printf(m, "  retry_later: %llu\n", prof->retry_later);
+  seq_printf(m, "  sleeps: %llu\n", prof->sleeps);
+  seq_printf(m, "  sleep_ns: %llu\n", prof->sleep_ns);
+  seq_printf(m, "  queue_len: %u\n", prof->queue_len);
+  seq_printf(m, "  avg_queue_len: %llu\n", (0 == prof->passes) ? 0 : div64_u64(prof->queue_len_sum, prof->passes));
+  seq_printf(m, "  max_queue_len: %u\n", prof->max_queue_len);
+  seq_printf(m, "  oldest_task_ms: %u\n", (0 == oldest) ? 0 : jiffies_to_msecs(jiffies - oldest));
+}
+
+static int worker_prof_show(struct seq_file *m, void *unused)
+{
+  dysk_worker *dw = (dysk_worker *) m->private;
+  seq_printf(m, "node: %d\ndysks: %u\nparked: %d\n", dw->node, dw->count_dysks, atomic_read(&dw->count_parked));
+  show_stage(m, "send", &dw->prof[W_STAGE_SEND]);
+  show_stage(m, "receive", &dw->prof[W_STAGE_RECEIVE]);
+  return 0;
+}
+
+static int worker_prof_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, worker_prof_show, inode->i_private);
+}
+
+static const struct file_operations worker_prof_fops = {
+  .owner   = THIS_MODULE,
+  .open    = worker_prof_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
 // big loop
 static int work_thread_fn(void *args)
 {
   dysk_worker *dw;
+  w_stage_prof *prof;
   dw = (dysk_worker *) args;
+  prof = &dw->prof[W_STAGE_SEND];
   printk(KERN_INFO "Dysk worker starting");
+  // worker serves writeback, its allocations must not recurse into i/o
+  memalloc_noio_save();
 
   while (!kthread_should_stop()) {
-    w_task *t, *next;
-    // loop and execute
-    list_for_each_entry_safe(t, next, &dw->head->list, list)
-    execute(dw, t);
+    dysk_runq *rq;
+    prof_pass_begin(prof);
+    splice_submissions(dw);
+    reap_runqs(dw);
+    // loop and execute, a dysk at a time
+    list_for_each_entry(rq, &dw->runqs, list)
+    serve_runq(dw, rq);
 
-    if (0 == atomic_read(&dw->count_tasks)) {
-      // Yield cpu if we have no work.
-      set_current_state(TASK_INTERRUPTIBLE);
-      schedule_timeout(HZ / 1000);
-    }
+    prof_pass_end(prof, atomic_read(&dw->count_tasks));
+
+    if (atomic_read(&dw->count_tasks) == atomic_read(&dw->count_parked)) stage_sleep(prof);
   }
 
   dw->working = 0;
   return 0;
 }
+
+// receive stage loop
+static int rx_thread_fn(void *args)
+{
+  dysk_worker *dw;
+  w_stage_prof *prof;
+  struct llist_node *handoff;
+  w_task *t, *next;
+  dw = (dysk_worker *) args;
+  prof = &dw->prof[W_STAGE_RECEIVE];
+  memalloc_noio_save();
+
+  while (!kthread_should_stop()) {
+    prof_pass_begin(prof);
+    // take what send stage handed off, in the order it was handed off
+    handoff = llist_reverse_order(llist_del_all(&dw->rx_handoff));
+    llist_for_each_entry_safe(t, next, handoff, handoff)
+    list_add_tail(&t->list, &dw->rx_tasks);
+
+    list_for_each_entry_safe(t, next, &dw->rx_tasks, list)
+    execute(dw, t);
+
+    prof_pass_end(prof, atomic_read(&dw->count_rx_tasks));
+
+    if (0 == atomic_read(&dw->count_rx_tasks)) stage_sleep(prof);
+  }
+
+  dw->rx_working = 0;
+  return 0;
+}
+
+// creates a stage thread bound to worker's node
+static struct task_struct *stage_thread(dysk_worker *dw, int (*fn)(void *), const char *name)
+{
+  struct task_struct *t;
+  t = kthread_create_on_node(fn, dw, dw->node, name, dw->node);
+
+  if (IS_ERR(t)) return NULL;
+
+  // keep it on its node, so what it allocates stays local
+  set_cpus_allowed_ptr(t, cpumask_of_node(dw->node));
+  wake_up_process(t);
+  return t;
+}
 // -----------------------------
 // init + tear down routines
 // -----------------------------
-int dysk_worker_init(dysk_worker *dw)
+int dysk_worker_init(dysk_worker *dw, int node)
 {
-  w_task *w = NULL;
+  char name[16];
+  dw->node = node;
+  dw->count_dysks = 0;
+  snprintf(dw->slab_name, sizeof(dw->slab_name), WORKER_SLAB_NAME, node);
   // allocate slab
-  dw->tasks_slab = kmem_cache_create(WORKER_SLAB_NAME,
+  dw->tasks_slab = kmem_cache_create(dw->slab_name,
                                      sizeof(w_task),
                                      0, /*no special behavior */
-                                     0, /* no alignment a cache miss is ok, for now */
+                                     SLAB_HWCACHE_ALIGN, /* tasks are hot, keep them off shared lines */
                                      NULL /*let kernel create pages */);
 
   if (NULL == dw->tasks_slab) {
@@ -190,26 +965,37 @@ int dysk_worker_init(dysk_worker *dw)
     goto fail;
   }
 
-  w = kmem_cache_alloc(dw->tasks_slab, GFP_NOIO);
-
-  if (!w) goto fail;
-
-  memset(w, 0, sizeof(w_task));
-  dw->head = w;
   // stop signal
   dw->working = 1;
   // count of tasks
   atomic_set(&dw->count_tasks, 0);
-  // init queue
-  INIT_LIST_HEAD(&dw->head->list);
+  atomic_set(&dw->count_parked, 0);
+  // init dysk queues
+  INIT_LIST_HEAD(&dw->runqs);
   // init the lock
   spin_lock_init(&dw->lock);
-  // Create worker thread
-  // We are using one worker per entire dysk, hence the static name
-  dw->worker_thread = kthread_run(work_thread_fn, dw, "dysk-worker-%d", 0);
+  // submissions and per cpu free tasks
+  init_llist_head(&dw->submissions);
+  dw->task_cache = alloc_percpu(struct w_task_cache);
+
+  if (!dw->task_cache) goto fail;
+
+  // receive stage
+  init_llist_head(&dw->rx_handoff);
+  INIT_LIST_HEAD(&dw->rx_tasks);
+  atomic_set(&dw->count_rx_tasks, 0);
+  dw->rx_working = 1;
+  // Create worker threads, one pipeline per node
+  dw->worker_thread = stage_thread(dw, work_thread_fn, "dysk-worker-%d");
+
+  if (!dw->worker_thread) goto fail;
+
+  dw->rx_thread = stage_thread(dw, rx_thread_fn, "dysk-rx-%d");
 
-  if (IS_ERR(dw->worker_thread)) goto fail;
+  if (!dw->rx_thread) goto fail;
 
+  snprintf(name, sizeof(name), "worker-%d", node);
+  dw->debugfs = debugfs_create_file(name, 0444, dysk_debugfs, dw, &worker_prof_fops);
   return 0;
 fail:
   dysk_worker_teardown(dw);
@@ -218,8 +1004,13 @@ fail:
 
 void dysk_worker_teardown(dysk_worker *dw)
 {
+  int cpu;
+
   if (!dw) return;
 
+  debugfs_remove(dw->debugfs);
+  dw->debugfs = NULL;
+
   // assuming that stop func deallocates the memory allocated for worker_thread
   if (dw->worker_thread) {
     kthread_stop(dw->worker_thread);
@@ -231,9 +1022,34 @@ void dysk_worker_teardown(dysk_worker *dw)
     }
   }
 
-  // if head object is there free it.
-  if (dw->head) kmem_cache_free(dw->tasks_slab, dw->head);
+  dw->worker_thread = NULL;
+
+  if (dw->rx_thread) {
+    kthread_stop(dw->rx_thread);
+
+    while (1 == dw->rx_working) {
+      printk(KERN_INFO "Waiting for worker receive stage to stop..");
+      set_current_state(TASK_INTERRUPTIBLE);
+      schedule_timeout(1 * HZ);
+    }
+  }
+
+  dw->rx_thread = NULL;
+
+  // return cached tasks before the slab goes
+  if (dw->task_cache) {
+    for_each_possible_cpu(cpu) {
+      struct w_task_cache *cache = per_cpu_ptr(dw->task_cache, cpu);
+
+      while (0 != cache->count) kmem_cache_free(dw->tasks_slab, cache->tasks[--cache->count]);
+    }
+
+    free_percpu(dw->task_cache);
+    dw->task_cache = NULL;
+  }
 
   // destroy the cache
   if (dw->tasks_slab) kmem_cache_destroy(dw->tasks_slab);
+
+  dw->tasks_slab = NULL;
 }
@@ -0,0 +1,330 @@
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/err.h>
+// Mem
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+// IO
+#include <linux/blkdev.h>
+// Time
+#include <linux/ktime.h>
+// Params
+#include <linux/moduleparam.h>
+
+#include "dysk_bdd.h"
+#include "mem.h"
+#include "dysk_trace.h"
+
+#define MEM_NOMEM_RETRY_DELAY (HZ / 100) // back off when memory is short
+#define RAM_PAGE_SECTORS      (PAGE_SIZE >> 9)
+#define RAM_FREE_BATCH        16         // pages looked up per pass while freeing
+
+// memory held by all ram dysks
+static unsigned int ram_max_mb = 1024;
+module_param(ram_max_mb, uint, 0644);
+MODULE_PARM_DESC(ram_max_mb, "max memory (MB) held by all ram transport dysks, writes to new pages past it fail");
+
+static atomic_long_t ram_pages = ATOMIC_LONG_INIT(0);
+
+typedef struct ram_state ram_state;
+typedef struct __memstate __memstate;
+
+// per ram dysk, pages are indexed by sector / RAM_PAGE_SECTORS
+// and never freed before the dysk is deleted
+struct ram_state {
+  // serializes inserts, lookups are rcu
+  spinlock_t lock;
+  struct radix_tree_root pages;
+};
+
+// a span, handed from send to receive task
+struct __memstate {
+  struct request *span[DYSK_SPAN_MAX];
+  int span_count;
+  u64 start_ns;
+  // set by send if the span failed
+  int err;
+};
+
+task_result __mem_send(w_task *this_task);
+task_result __mem_receive(w_task *this_task);
+void __clean_mem_send(w_task *this_task, task_clean_reason clean_reason);
+void __clean_mem_receive(w_task *this_task, task_clean_reason clean_reason);
+
+// ---------------------------
+// RAM store
+// ---------------------------
+static struct page *ram_page_lookup(ram_state *ram, sector_t sector)
+{
+  struct page *page;
+  rcu_read_lock();
+  page = radix_tree_lookup(&ram->pages, sector / RAM_PAGE_SECTORS);
+  rcu_read_unlock();
+  return page;
+}
+
+// returns page backing sector, allocates it if needed (may sleep)
+static struct page *ram_page_insert(ram_state *ram, sector_t sector)
+{
+  pgoff_t idx = sector / RAM_PAGE_SECTORS;
+  struct page *page;
+
+  if (NULL != (page = ram_page_lookup(ram, sector))) return page;
+
+  if (atomic_long_read(&ram_pages) >= ((long) ram_max_mb << (20 - PAGE_SHIFT))) return ERR_PTR(-ENOSPC);
+
+  if (!(page = alloc_page(GFP_NOIO | __GFP_ZERO))) return ERR_PTR(-ENOMEM);
+
+  if (0 != radix_tree_preload(GFP_NOIO)) {
+    __free_page(page);
+    return ERR_PTR(-ENOMEM);
+  }
+
+  spin_lock(&ram->lock);
+  page->index = idx;
+
+  if (0 != radix_tree_insert(&ram->pages, idx, page)) {
+    // lost the race
+    __free_page(page);
+    page = radix_tree_lookup(&ram->pages, idx);
+  } else {
+    atomic_long_inc(&ram_pages);
+  }
+
+  spin_unlock(&ram->lock);
+  radix_tree_preload_end();
+  return page;
+}
+
+// allocates pages of a write ahead of the copy, copy runs atomic
+static int ram_reserve(ram_state *ram, struct request *req)
+{
+  sector_t sector = blk_rq_pos(req);
+  sector_t last   = sector + blk_rq_sectors(req) - 1;
+  struct page *page;
+
+  for (sector -= sector % RAM_PAGE_SECTORS; sector <= last; sector += RAM_PAGE_SECTORS) {
+    page = ram_page_insert(ram, sector);
+
+    if (IS_ERR(page)) return PTR_ERR(page);
+  }
+
+  return 0;
+}
+
+// copies len bytes between buffer and store starting at sector, pages
+// that were never written read as zeros
+static void ram_copy(ram_state *ram, void *buffer, sector_t sector, size_t len, int dir)
+{
+  size_t offset, chunk;
+  struct page *page;
+  void *mem;
+
+  while (len) {
+    offset = (sector % RAM_PAGE_SECTORS) << 9;
+    chunk  = min_t(size_t, len, PAGE_SIZE - offset);
+    page   = ram_page_lookup(ram, sector);
+
+    if (!page) {
+      if (READ == dir) memset(buffer, 0, chunk);
+    } else {
+      mem = kmap_atomic(page);
+
+      if (WRITE == dir)
+        memcpy(mem + offset, buffer, chunk);
+      else
+        memcpy(buffer, mem + offset, chunk);
+
+      kunmap_atomic(mem);
+    }
+
+    buffer += chunk;
+    sector += chunk >> 9;
+    len    -= chunk;
+  }
+}
+
+// moves data of a request between its pages and the store
+// ram is NULL for the null transport
+static void mem_copy_request(ram_state *ram, struct request *req)
+{
+  struct req_iterator iter;
+  struct bio_vec bvec;
+  sector_t sector = blk_rq_pos(req);
+  int dir         = rq_data_dir(req);
+  void *buffer;
+#if NEW_KERNEL
+  rq_for_each_segment(bvec, req, iter) {
+#else
+  struct bio_vec *_bvec;
+  rq_for_each_segment(_bvec, req, iter) {
+  memcpy(&bvec, _bvec, sizeof(struct bio_vec));
+#endif
+    buffer = kmap_atomic(bvec.bv_page);
+
+    if (ram)
+      ram_copy(ram, buffer + bvec.bv_offset, sector, bvec.bv_len, dir);
+    else if (READ == dir)
+      memset(buffer + bvec.bv_offset, 0, bvec.bv_len);
+
+    kunmap_atomic(buffer);
+    sector += bvec.bv_len >> 9;
+  }
+}
+
+// ---------------------------
+// Tasks
+// ---------------------------
+// writes land here, then receive stage completes the span
+task_result __mem_send(w_task *this_task)
+{
+  __memstate *memstate = (__memstate *) this_task->state;
+  ram_state *ram       = (ram_state *) this_task->d->xfer_state;
+  struct request *req  = memstate->span[0];
+
+  if (WRITE == rq_data_dir(req) && ram && 0 == memstate->err) {
+    memstate->err = ram_reserve(ram, req);
+
+    if (-ENOMEM == memstate->err) {
+      memstate->err = 0;
+      return w_task_retry_after(this_task, MEM_NOMEM_RETRY_DELAY);
+    }
+
+    if (0 == memstate->err) mem_copy_request(ram, req);
+  }
+
+  trace_dysk_rq_body_sent(this_task->d, req, 0);
+
+  if (0 != queue_w_rx_task(this_task, &__mem_receive, &__clean_mem_receive, memstate))
+    return w_task_retry_after(this_task, MEM_NOMEM_RETRY_DELAY);
+
+  return done;
+}
+
+// reads are served here
+task_result __mem_receive(w_task *this_task)
+{
+  __memstate *memstate = (__memstate *) this_task->state;
+  ram_state *ram       = (ram_state *) this_task->d->xfer_state;
+  int i;
+
+  trace_dysk_rq_first_byte(this_task->d, memstate->span[0], 0);
+
+  for (i = 0; 0 == memstate->err && i < memstate->span_count; i++) {
+    if (READ == rq_data_dir(memstate->span[i])) mem_copy_request(ram, memstate->span[i]);
+  }
+
+  return done;
+}
+
+// on success state is owned by receive task
+void __clean_mem_send(w_task *this_task, task_clean_reason clean_reason)
+{
+  __memstate *memstate = (__memstate *) this_task->state;
+
+  if (clean_done == clean_reason) return;
+
+  io_end_span(this_task, memstate->span, memstate->span_count, memstate->start_ns, (clean_timeout == clean_reason) ? -EAGAIN : -EIO);
+  kfree(memstate);
+}
+
+void __clean_mem_receive(w_task *this_task, task_clean_reason clean_reason)
+{
+  __memstate *memstate = (__memstate *) this_task->state;
+  int err              = memstate->err;
+
+  if (clean_done != clean_reason) err = (clean_timeout == clean_reason) ? -EAGAIN : -EIO;
+
+  io_end_span(this_task, memstate->span, memstate->span_count, memstate->start_ns, err);
+  kfree(memstate);
+}
+
+// ---------------------------
+// Entry points
+// ---------------------------
+static int mem_do_request(dysk *d, struct request **span, int span_count, int last)
+{
+  __memstate *memstate = NULL;
+  int success          = 0;
+  memstate = kmalloc_node(sizeof(__memstate), GFP_NOIO, d->worker->node);
+
+  if (!memstate) return -ENOMEM;
+
+  memset(memstate, 0, sizeof(__memstate));
+  memcpy(memstate->span, span, span_count * sizeof(struct request *));
+  memstate->span_count = span_count;
+  memstate->start_ns   = ktime_get_ns();
+  trace_dysk_rq_queue(d, span[0], 0);
+  success = run_w_task(d, span[0], &__mem_send, &__clean_mem_send, normal, memstate, last);
+
+  if (0 != success) kfree(memstate);
+
+  return success;
+}
+
+static int null_init_for_dysk(dysk *d)
+{
+  d->xfer_state = NULL;
+  return 0;
+}
+
+static void null_teardown_for_dysk(dysk *d)
+{
+}
+
+static int ram_init_for_dysk(dysk *d)
+{
+  ram_state *ram = kmalloc(sizeof(ram_state), GFP_KERNEL);
+
+  if (!ram) return -ENOMEM;
+
+  spin_lock_init(&ram->lock);
+  INIT_RADIX_TREE(&ram->pages, GFP_ATOMIC);
+  d->xfer_state = ram;
+  return 0;
+}
+
+static void ram_teardown_for_dysk(dysk *d)
+{
+  ram_state *ram = (ram_state *) d->xfer_state;
+  struct page *pages[RAM_FREE_BATCH];
+  unsigned long pos = 0;
+  int count, i;
+
+  if (!ram) return; // already cleaned
+
+  do {
+    count = radix_tree_gang_lookup(&ram->pages, (void **) pages, pos, RAM_FREE_BATCH);
+
+    for (i = 0; i < count; i++) {
+      pos = pages[i]->index;
+      radix_tree_delete(&ram->pages, pos);
+      __free_page(pages[i]);
+    }
+
+    atomic_long_sub(count, &ram_pages);
+    pos++;
+  } while (RAM_FREE_BATCH == count);
+
+  kfree(ram);
+  d->xfer_state = NULL;
+}
+
+const dysk_xfer null_xfer = {
+  .name              = "null",
+  .init_for_dysk     = null_init_for_dysk,
+  .teardown_for_dysk = null_teardown_for_dysk,
+  .do_request        = mem_do_request,
+};
+
+const dysk_xfer ram_xfer = {
+  .name              = "ram",
+  .init_for_dysk     = ram_init_for_dysk,
+  .teardown_for_dysk = ram_teardown_for_dysk,
+  .do_request        = mem_do_request,
+};
@@ -0,0 +1,18 @@
+#ifndef _MEM_H
+#define _MEM_H
+
+#include "dysk_bdd.h"
+
+/*
+ In memory transports. They take the same path through worker
+ (send then receive stage) as az but never leave the box, used
+ to measure dysk's own overhead (block layer, worker, dispatch).
+*/
+
+// DYSK_XFER_NULL: reads return zeros, writes are dropped
+extern const dysk_xfer null_xfer;
+
+// DYSK_XFER_RAM: data lives in pages allocated on first write
+extern const dysk_xfer ram_xfer;
+
+#endif
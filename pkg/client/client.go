@@ -37,14 +37,35 @@ const (
 	HOST_LEN         = 512
 	IP_LEN           = 32
 	LEASE_ID_LEN     = 64
+
+	// worker scheduling weight as expected by the module
+	MIN_WEIGHT     = 1
+	MAX_WEIGHT     = 1000
+	DEFAULT_WEIGHT = 100
+
+	// max latency target (ms) as expected by the module
+	MAX_LATENCY_TARGET_MS = 60000
+
+	// max polling time (us) as expected by the module
+	MAX_POLL_US = 5000
+
+	// storage endpoint port, unless realm says otherwise (host:port)
+	DEFAULT_PORT = 80
 )
 
+// transports in the order the module numbers them
+var transports = []DyskTransport{TransportAz, TransportNull, TransportRam}
+
 type DyskClient interface {
 	Mount(d *Dysk, autoLease, breakExistingLease bool) error
 	Unmount(name string, breakLease bool) error
 	BreakLease(d *Dysk) error
 	Get(name string) (*Dysk, error)
 	List() ([]*Dysk, error)
+	Stats(name string) (*DyskStats, error)
+	HeatMap(name string) (*DyskHeatMap, error)
+	Trace(name string) (*DyskTrace, []byte, error)
+	RestartTrace(name string) error
 	CreatePageBlob(sizeGB uint, container string, pageBlobName string, is_vhd bool, lease bool) (string, error)
 	DeletePageBlob(container string, pageBlobName string, leaseId string, breakExistingLease bool) error
 	//LeaseAndValidate(d *Dysk, breakExistingLease bool) (string, error)
@@ -188,7 +209,12 @@ func (c *dyskclient) Mount(d *Dysk, autoLease, breakExistingLease bool) error {
 	}
 	defer c.closeDeviceFile()
 
-	err := c.pre_mount(d, autoLease, breakExistingLease)
+	var err error
+	if isLocalTransport(d.Transport) {
+		err = c.pre_mount_local(d)
+	} else {
+		err = c.pre_mount(d, autoLease, breakExistingLease)
+	}
 	if nil != err {
 		return err
 	}
@@ -449,6 +475,20 @@ func (c *dyskclient) pre_mount(d *Dysk, autoLease, breakExistingLease bool) erro
 	return c.validateDysk(d)
 }
 
+// in memory transports have no page blob, lease or sas
+func (c *dyskclient) pre_mount_local(d *Dysk) error {
+	if "" == d.AccountName {
+		d.AccountName = string(d.Transport)
+	}
+	d.Sas = ""
+	d.LeaseId = ""
+	d.Vhd = false
+	d.port = DEFAULT_PORT
+	d.sectorCount = uint64(d.SizeGB) * 1024 * 1024 * 1024 / 512
+
+	return c.validateDysk(d)
+}
+
 func (c *dyskclient) post_get(d *Dysk) {
 	// Convert sector count to size
 	// check if we are VHD by measuring the difference between azure's size and disk size
@@ -549,6 +589,15 @@ func (c *dyskclient) validateDysk(d *Dysk) error {
 		return fmt.Errorf("Invalid Sector count.")
 	}
 
+	if "" != d.Transport && -1 == transportId(d.Transport) {
+		return fmt.Errorf("Invalid transport. Must be one of %v", transports)
+	}
+
+	// nothing to look up or lease for in memory transports
+	if isLocalTransport(d.Transport) {
+		return validateScheduling(d)
+	}
+
 	if 0 == len(d.AccountName) || ACCOUNT_NAME_LEN < len(d.AccountName) {
 		return fmt.Errorf("Invalid Account name. Must be <= than 256")
 	}
@@ -587,15 +636,69 @@ func (c *dyskclient) validateDysk(d *Dysk) error {
 		return fmt.Errorf("Invalid Lease Id. Must be <= 32")
 	}
 
-	addr, err := net.LookupIP(d.host)
+	if err := validateScheduling(d); nil != err {
+		return err
+	}
+
+	// realms of local emulators carry a port (host:port)
+	lookupHost := d.host
+	d.port = DEFAULT_PORT
+	if h, p, err := net.SplitHostPort(d.host); nil == err {
+		port, err := strconv.ParseUint(p, 10, 16)
+		if nil != err || 0 == port {
+			return fmt.Errorf("Invalid port in host:%s", d.host)
+		}
+		lookupHost = h
+		d.port = uint(port)
+	}
+
+	addr, err := net.LookupIP(lookupHost)
 	if nil != err {
-		return fmt.Errorf("Failed to lookup ip for host:%s", d.host)
+		return fmt.Errorf("Failed to lookup ip for host:%s", lookupHost)
 	}
 	d.ip = addr[0].String()
 
 	return c.validateLease(d)
 }
 
+// weight, latency target and polling
+func validateScheduling(d *Dysk) error {
+	if 0 == d.Weight {
+		d.Weight = DEFAULT_WEIGHT
+	}
+
+	if MIN_WEIGHT > d.Weight || MAX_WEIGHT < d.Weight {
+		return fmt.Errorf("Invalid weight. Must be between %d and %d", MIN_WEIGHT, MAX_WEIGHT)
+	}
+
+	if MAX_LATENCY_TARGET_MS < d.LatencyTargetMs {
+		return fmt.Errorf("Invalid latency target. Must be <= %d ms", MAX_LATENCY_TARGET_MS)
+	}
+
+	if MAX_POLL_US < d.PollUs {
+		return fmt.Errorf("Invalid poll time. Must be <= %d us", MAX_POLL_US)
+	}
+
+	return nil
+}
+
+func isLocalTransport(t DyskTransport) bool {
+	return "" != t && TransportAz != t
+}
+
+// module's number of a transport, -1 if unknown
+func transportId(t DyskTransport) int {
+	if "" == t {
+		return 0
+	}
+	for id, each := range transports {
+		if each == t {
+			return id
+		}
+	}
+	return -1
+}
+
 // Converts a byte slice to a response object
 func parseResponse(bytes []byte) *moduleResponse {
 	s := string(bytes)
@@ -627,18 +730,65 @@ func string2dysk(asstring string) (*Dysk, error) {
 	}
 	is_vhd, err := strconv.ParseInt(split[11], 10, 64)
 
+	// trailing fields, older modules don't send them
+	weight := uint64(DEFAULT_WEIGHT)
+	if 13 < len(split) {
+		weight, err = strconv.ParseUint(split[12], 10, 64)
+		if nil != err {
+			return nil, err
+		}
+	}
+
+	latencyTargetMs := uint64(0)
+	if 14 < len(split) {
+		latencyTargetMs, err = strconv.ParseUint(split[13], 10, 64)
+		if nil != err {
+			return nil, err
+		}
+	}
+
+	pollUs := uint64(0)
+	if 15 < len(split) {
+		pollUs, err = strconv.ParseUint(split[14], 10, 64)
+		if nil != err {
+			return nil, err
+		}
+	}
+
+	port := uint64(DEFAULT_PORT)
+	if 16 < len(split) {
+		port, err = strconv.ParseUint(split[15], 10, 64)
+		if nil != err {
+			return nil, err
+		}
+	}
+
+	transport := TransportAz
+	if 17 < len(split) {
+		id, err := strconv.ParseUint(split[16], 10, 64)
+		if nil != err || uint64(len(transports)) <= id {
+			return nil, fmt.Errorf("Invalid transport %q", split[16])
+		}
+		transport = transports[id]
+	}
+
 	d := Dysk{
-		Type:        DyskType(split[0]),
-		Name:        split[1],
-		sectorCount: sectorCount,
-		AccountName: split[3],
-		Sas:         split[4],
-		Path:        split[5],
-		host:        split[6],
-		ip:          split[7],
-		LeaseId:     split[8],
-		Major:       int(major),
-		Minor:       int(minor),
+		Type:            DyskType(split[0]),
+		Name:            split[1],
+		sectorCount:     sectorCount,
+		AccountName:     split[3],
+		Sas:             split[4],
+		Path:            split[5],
+		host:            split[6],
+		ip:              split[7],
+		LeaseId:         split[8],
+		Major:           int(major),
+		Minor:           int(minor),
+		Weight:          uint(weight),
+		LatencyTargetMs: uint(latencyTargetMs),
+		PollUs:          uint(pollUs),
+		port:            uint(port),
+		Transport:       transport,
 	}
 	if 1 == is_vhd {
 		d.Vhd = true
@@ -673,8 +823,8 @@ func (c *dyskclient) getDyskSas(d *Dysk) (string, error) {
 
 // dysk as string
 func (c *dyskclient) dysk2string(d *Dysk) (string, error) {
-	//type-devicename-sectorcount-accountname-accountkey-path-host-ip-lease-vhd
-	const format string = "%s\n%s\n%d\n%s\n%s\n%s\n%s\n%s\n%s\n%d\n"
+	//type-devicename-sectorcount-accountname-accountkey-path-host-ip-lease-vhd-weight-latencytarget-poll-port-transport
+	const format string = "%s\n%s\n%d\n%s\n%s\n%s\n%s\n%s\n%s\n%d\n%d\n%d\n%d\n%d\n%d\n"
 	is_vhd := 0
 	if d.Vhd {
 		is_vhd = 1
@@ -685,7 +835,9 @@ func (c *dyskclient) dysk2string(d *Dysk) (string, error) {
 	var sas string
 	var err error
 
-	if c.storageAccountSas == "" {
+	if isLocalTransport(d.Transport) {
+		sas = ""
+	} else if c.storageAccountSas == "" {
 		sas, err = c.getDyskSas(d)
 	} else {
 		sas = c.storageAccountSas
@@ -694,7 +846,7 @@ func (c *dyskclient) dysk2string(d *Dysk) (string, error) {
 	if nil != err {
 		return "", err
 	}
-	out := fmt.Sprintf(format, d.Type, d.Name, d.sectorCount, d.AccountName, sas, d.Path, d.host, d.ip, d.LeaseId, is_vhd)
+	out := fmt.Sprintf(format, d.Type, d.Name, d.sectorCount, d.AccountName, sas, d.Path, d.host, d.ip, d.LeaseId, is_vhd, d.Weight, d.LatencyTargetMs, d.PollUs, d.port, transportId(d.Transport))
 	return out, nil
 }
 
@@ -0,0 +1,55 @@
+package client
+
+import (
+	"fmt"
+	"io/ioutil"
+	"path"
+	"strings"
+)
+
+// per dysk debug files exposed by the module (needs debugfs mounted)
+const debugfsPath = "/sys/kernel/debug/dysk"
+
+type HeatRegion struct {
+	FirstSector uint64
+	LastSector  uint64
+	Reads       uint64
+	Writes      uint64
+	Bytes       uint64
+}
+
+type DyskHeatMap struct {
+	Name          string
+	Regions       uint64
+	RegionSectors uint64
+	// only regions that were touched
+	Touched []HeatRegion
+}
+
+func (c *dyskclient) HeatMap(deviceName string) (*DyskHeatMap, error) {
+	if err := isValidDeviceName(deviceName); nil != err {
+		return nil, err
+	}
+
+	raw, err := ioutil.ReadFile(path.Join(debugfsPath, deviceName, "heatmap"))
+	if nil != err {
+		return nil, fmt.Errorf("Failed to read heat map of %s (is it mounted with heatmap_regions set, debugfs mounted?): %v", deviceName, err)
+	}
+
+	lines := strings.Split(strings.TrimSpace(string(raw)), "\n")
+	h := &DyskHeatMap{Name: deviceName, Touched: make([]HeatRegion, 0)}
+
+	if _, err := fmt.Sscanf(lines[0], "regions %d region_sectors %d", &h.Regions, &h.RegionSectors); nil != err {
+		return nil, fmt.Errorf("Invalid heat map header %q", lines[0])
+	}
+
+	for _, line := range lines[1:] {
+		var r HeatRegion
+		if _, err := fmt.Sscanf(line, "%d %d %d %d %d", &r.FirstSector, &r.LastSector, &r.Reads, &r.Writes, &r.Bytes); nil != err {
+			return nil, fmt.Errorf("Invalid heat map line %q", line)
+		}
+		h.Touched = append(h.Touched, r)
+	}
+
+	return h, nil
+}
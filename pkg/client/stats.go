@@ -0,0 +1,105 @@
+package client
+
+import (
+	"fmt"
+	"io/ioutil"
+	"path"
+	"strconv"
+	"strings"
+)
+
+// per dysk stats exposed by the module
+const sysBlockPath = "/sys/block"
+
+type LatencyBucket struct {
+	// upper bound (us), 0 for the last bucket (no bound)
+	UpperUs uint64
+	Count   uint64
+}
+
+type DyskStats struct {
+	Name            string
+	Reads           uint64
+	Writes          uint64
+	ReadBytes       uint64
+	WriteBytes      uint64
+	ReadErrors      uint64
+	WriteErrors     uint64
+	Resends         uint64
+	ConnFailures    uint64
+	Throttles       uint64
+	ThrottledMs     uint64
+	Timeouts        uint64
+	InflightBytes   uint64
+	InflightReqs    uint64
+	Connections     uint64
+	PeakConnections uint64
+	ReadLatencyUs   []LatencyBucket
+	WriteLatencyUs  []LatencyBucket
+}
+
+func (c *dyskclient) Stats(deviceName string) (*DyskStats, error) {
+	if err := isValidDeviceName(deviceName); nil != err {
+		return nil, err
+	}
+
+	dir := path.Join(sysBlockPath, deviceName, "dysk")
+	s := &DyskStats{Name: deviceName}
+
+	counters := map[string]*uint64{
+		"reads":            &s.Reads,
+		"writes":           &s.Writes,
+		"read_bytes":       &s.ReadBytes,
+		"write_bytes":      &s.WriteBytes,
+		"read_errors":      &s.ReadErrors,
+		"write_errors":     &s.WriteErrors,
+		"resends":          &s.Resends,
+		"conn_failures":    &s.ConnFailures,
+		"throttles":        &s.Throttles,
+		"throttled_ms":     &s.ThrottledMs,
+		"timeouts":         &s.Timeouts,
+		"inflight_bytes":   &s.InflightBytes,
+		"inflight_reqs":    &s.InflightReqs,
+		"connections":      &s.Connections,
+		"peak_connections": &s.PeakConnections,
+	}
+
+	for name, value := range counters {
+		raw, err := ioutil.ReadFile(path.Join(dir, name))
+		if nil != err {
+			return nil, fmt.Errorf("Failed to read stats of %s (is it mounted?): %v", deviceName, err)
+		}
+		if *value, err = strconv.ParseUint(strings.TrimSpace(string(raw)), 10, 64); nil != err {
+			return nil, fmt.Errorf("Invalid %s stat of %s: %v", name, deviceName, err)
+		}
+	}
+
+	var err error
+	if s.ReadLatencyUs, err = readLatencyHistogram(path.Join(dir, "read_latency_us")); nil != err {
+		return nil, err
+	}
+	if s.WriteLatencyUs, err = readLatencyHistogram(path.Join(dir, "write_latency_us")); nil != err {
+		return nil, err
+	}
+
+	return s, nil
+}
+
+// histogram file is "<upper bound us> <count>" per line
+func readLatencyHistogram(file string) ([]LatencyBucket, error) {
+	raw, err := ioutil.ReadFile(file)
+	if nil != err {
+		return nil, err
+	}
+
+	buckets := make([]LatencyBucket, 0)
+	for _, line := range strings.Split(strings.TrimSpace(string(raw)), "\n") {
+		var b LatencyBucket
+		if _, err := fmt.Sscanf(line, "%d %d", &b.UpperUs, &b.Count); nil != err {
+			return nil, fmt.Errorf("Invalid latency histogram line %q in %s", line, file)
+		}
+		buckets = append(buckets, b)
+	}
+
+	return buckets, nil
+}
@@ -0,0 +1,298 @@
+package client
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"math"
+	"os"
+	"path"
+	"sort"
+	"sync"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// must match dysk_trace_hdr and dysk_trace_rec (dysk_bdd.h)
+const (
+	traceMagic   = 0x43525444 // "DTRC"
+	traceVersion = 1
+
+	TraceWrite = 1 << 0
+	TraceSync  = 1 << 1
+	TraceFua   = 1 << 2
+	TraceMeta  = 1 << 3
+)
+
+type traceHeader struct {
+	Magic      uint32
+	Version    uint16
+	RecordSize uint16
+	Count      uint32
+	Capacity   uint32
+	Recorded   uint64
+}
+
+type TraceRecord struct {
+	Sector  uint64
+	Bytes   uint32
+	DeltaUs uint32 // since previous request
+	Flags   uint32 // Trace*
+	Seq     uint32
+}
+
+type DyskTrace struct {
+	// records ever recorded, older ones than Records were overwritten
+	Recorded uint64
+	Capacity uint32
+	Records  []TraceRecord
+}
+
+// reads the i/o trace of a dysk mounted on this host, raw is the trace file
+// as the module exposes it (can be saved and replayed later elsewhere)
+func (c *dyskclient) Trace(deviceName string) (*DyskTrace, []byte, error) {
+	if err := isValidDeviceName(deviceName); nil != err {
+		return nil, nil, err
+	}
+
+	raw, err := ioutil.ReadFile(path.Join(debugfsPath, deviceName, "trace"))
+	if nil != err {
+		return nil, nil, fmt.Errorf("Failed to read i/o trace of %s (is it mounted with trace_entries set, debugfs mounted?): %v", deviceName, err)
+	}
+
+	t, err := ParseTrace(raw)
+	if nil != err {
+		return nil, nil, err
+	}
+	return t, raw, nil
+}
+
+// restarts the i/o trace of a dysk mounted on this host
+func (c *dyskclient) RestartTrace(deviceName string) error {
+	if err := isValidDeviceName(deviceName); nil != err {
+		return err
+	}
+
+	if err := ioutil.WriteFile(path.Join(debugfsPath, deviceName, "trace"), []byte("1"), 0600); nil != err {
+		return fmt.Errorf("Failed to restart i/o trace of %s: %v", deviceName, err)
+	}
+	return nil
+}
+
+// parses a trace as read from the module trace file
+func ParseTrace(raw []byte) (*DyskTrace, error) {
+	var h traceHeader
+	r := bytes.NewReader(raw)
+
+	if err := binary.Read(r, binary.LittleEndian, &h); nil != err {
+		return nil, fmt.Errorf("Invalid i/o trace header: %v", err)
+	}
+
+	if traceMagic != h.Magic || traceVersion != h.Version {
+		return nil, fmt.Errorf("Not a dysk i/o trace (or unsupported version %d)", h.Version)
+	}
+
+	if uintptr(h.RecordSize) != unsafe.Sizeof(TraceRecord{}) {
+		return nil, fmt.Errorf("Invalid i/o trace record size %d", h.RecordSize)
+	}
+
+	t := &DyskTrace{Recorded: h.Recorded, Capacity: h.Capacity, Records: make([]TraceRecord, h.Count)}
+	if err := binary.Read(r, binary.LittleEndian, t.Records); nil != err {
+		return nil, fmt.Errorf("Truncated i/o trace: %v", err)
+	}
+	return t, nil
+}
+
+// ---------------------------
+// Replay
+// ---------------------------
+type ReplayOptions struct {
+	// issue requests back to back instead of with their recorded timing
+	Fast bool
+	// requests in flight at most
+	Depth int
+	// leave writes out (target data is kept)
+	SkipWrites bool
+}
+
+type LatencySummary struct {
+	Ops    uint64
+	Bytes  uint64
+	Errors uint64
+	P50Us  uint64
+	P90Us  uint64
+	P99Us  uint64
+	P999Us uint64
+	MaxUs  uint64
+}
+
+type ReplayResult struct {
+	Device  string
+	Fast    bool
+	Elapsed time.Duration
+	Late    uint64 // issued later than recorded, all Depth slots were busy (timed replay)
+	Skipped uint64 // writes left out, or beyond end of device
+	Read    LatencySummary
+	Write   LatencySummary
+}
+
+// re-issues trace requests against a block device (O_DIRECT). Write
+// payload is not recorded, writes carry zeros.
+func ReplayTrace(t *DyskTrace, devicePath string, opts ReplayOptions) (*ReplayResult, error) {
+	if 0 >= opts.Depth {
+		return nil, fmt.Errorf("Replay depth must be at least 1")
+	}
+
+	openFlags := os.O_RDWR
+	if opts.SkipWrites {
+		openFlags = os.O_RDONLY
+	}
+
+	f, err := os.OpenFile(devicePath, openFlags|syscall.O_DIRECT, 0)
+	if nil != err {
+		return nil, fmt.Errorf("Failed to open %s: %v", devicePath, err)
+	}
+	defer f.Close()
+
+	// fua writes go through a data synced handle
+	var fsync *os.File
+	if !opts.SkipWrites {
+		if fsync, err = os.OpenFile(devicePath, os.O_WRONLY|syscall.O_DIRECT|syscall.O_DSYNC, 0); nil != err {
+			return nil, fmt.Errorf("Failed to open %s: %v", devicePath, err)
+		}
+		defer fsync.Close()
+	}
+
+	deviceBytes, err := f.Seek(0, io.SeekEnd)
+	if nil != err {
+		return nil, fmt.Errorf("Failed to size %s: %v", devicePath, err)
+	}
+
+	var maxBytes uint32
+	for _, rec := range t.Records {
+		if rec.Bytes > maxBytes {
+			maxBytes = rec.Bytes
+		}
+	}
+
+	res := &ReplayResult{Device: devicePath, Fast: opts.Fast}
+	// unbuffered, a send only goes through to an idle worker
+	ops := make(chan TraceRecord)
+	var lock sync.Mutex
+	var wg sync.WaitGroup
+	latencies := [2][]uint64{}
+	errors := [2]uint64{}
+	bytesDone := [2]uint64{}
+
+	start := time.Now()
+	for i := 0; i < opts.Depth; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			buf := alignedBuffer(int(maxBytes))
+			for rec := range ops {
+				dir := 0
+				if 0 != rec.Flags&TraceWrite {
+					dir = 1
+				}
+
+				b := buf[:rec.Bytes]
+				off := int64(rec.Sector) << 9
+				issued := time.Now()
+				var err error
+				switch {
+				case 0 == dir:
+					_, err = f.ReadAt(b, off)
+				case 0 != rec.Flags&TraceFua:
+					_, err = fsync.WriteAt(b, off)
+				default:
+					_, err = f.WriteAt(b, off)
+				}
+				us := uint64(time.Since(issued) / time.Microsecond)
+
+				lock.Lock()
+				if nil != err {
+					errors[dir]++
+				} else {
+					latencies[dir] = append(latencies[dir], us)
+					bytesDone[dir] += uint64(rec.Bytes)
+				}
+				lock.Unlock()
+			}
+		}()
+	}
+
+	var due time.Duration
+	for _, rec := range t.Records {
+		due += time.Duration(rec.DeltaUs) * time.Microsecond
+
+		if 0 != rec.Flags&TraceWrite && opts.SkipWrites {
+			res.Skipped++
+			continue
+		}
+
+		// traced on a bigger dysk
+		if int64(rec.Sector)<<9+int64(rec.Bytes) > deviceBytes {
+			res.Skipped++
+			continue
+		}
+
+		if !opts.Fast {
+			if wait := due - time.Since(start); 0 < wait {
+				time.Sleep(wait)
+			}
+
+			select {
+			case ops <- rec:
+				continue
+			default:
+				res.Late++
+			}
+		}
+		ops <- rec
+	}
+	close(ops)
+	wg.Wait()
+
+	res.Elapsed = time.Since(start)
+	res.Read = summarize(latencies[0], errors[0], bytesDone[0])
+	res.Write = summarize(latencies[1], errors[1], bytesDone[1])
+	return res, nil
+}
+
+// O_DIRECT needs buffers aligned to logical block size
+func alignedBuffer(size int) []byte {
+	const align = 4096
+	if 0 == size {
+		size = align
+	}
+
+	buf := make([]byte, size+align)
+	shift := 0
+	if rem := int(uintptr(unsafe.Pointer(&buf[0])) & (align - 1)); 0 != rem {
+		shift = align - rem
+	}
+	return buf[shift : shift+size]
+}
+
+func summarize(us []uint64, errors uint64, total uint64) LatencySummary {
+	s := LatencySummary{Ops: uint64(len(us)), Bytes: total, Errors: errors}
+	if 0 == len(us) {
+		return s
+	}
+
+	sort.Slice(us, func(i, j int) bool { return us[i] < us[j] })
+	pct := func(p float64) uint64 {
+		return us[int(math.Ceil(p*float64(len(us))))-1]
+	}
+
+	s.P50Us = pct(0.50)
+	s.P90Us = pct(0.90)
+	s.P99Us = pct(0.99)
+	s.P999Us = pct(0.999)
+	s.MaxUs = us[len(us)-1]
+	return s
+}
@@ -7,19 +7,34 @@ const (
 	ReadWrite DyskType = "RW"
 )
 
+// where dysk data goes, in memory transports are for benchmarking
+// dysk itself and need no storage account
+type DyskTransport string
+
+const (
+	TransportAz   DyskTransport = "az"
+	TransportNull DyskTransport = "null"
+	TransportRam  DyskTransport = "ram"
+)
+
 type Dysk struct {
-	Type         DyskType
-	Name         string
-	sectorCount  uint64
-	AccountName  string
-	Sas          string
-	Path         string
-	host         string
-	ip           string
-	LeaseId      string
-	Major        int
-	Minor        int
-	Vhd          bool
-	SizeGB       int
-	AccountRealm string
+	Type            DyskType
+	Name            string
+	sectorCount     uint64
+	AccountName     string
+	Sas             string
+	Path            string
+	host            string
+	ip              string
+	LeaseId         string
+	Major           int
+	Minor           int
+	Vhd             bool
+	SizeGB          int
+	AccountRealm    string
+	Weight          uint
+	LatencyTargetMs uint
+	PollUs          uint
+	port            uint
+	Transport       DyskTransport
 }
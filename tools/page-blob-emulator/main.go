@@ -0,0 +1,516 @@
+// page-blob-emulator serves the subset of Azure blob REST api used by
+// dysk (module and pkg/client) out of sparse files on local disk.
+//
+// Containers are directories and page blobs are sparse files under
+// -data-dir. Leases are kept in memory. Requests are not authenticated,
+// any account name/key is accepted.
+package main
+
+import (
+	"crypto/rand"
+	"encoding/xml"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"net/http"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+const (
+	pageSize = 512
+
+	// fallocate(2) modes
+	fallocKeepSize  = 0x01
+	fallocPunchHole = 0x02
+
+	// lseek(2) whence for sparse files
+	seekData = 3
+	seekHole = 4
+)
+
+var (
+	listen        = flag.String("listen", ":10000", "address to listen on")
+	dataDir       = flag.String("data-dir", "/var/lib/dysk-emulator", "directory containers and blobs are kept in")
+	latency       = flag.Duration("latency", 0, "added to every request (e.g. 2ms)")
+	bandwidthMBps = flag.Uint("bandwidth-mbps", 0, "MB/s shared by all transfers (0 no shaping)")
+	verbose       = flag.Bool("v", false, "log every request")
+)
+
+type lease struct {
+	id string
+}
+
+type emulator struct {
+	root string
+
+	lock   sync.Mutex
+	leases map[string]*lease // blob path -> active lease
+
+	// bandwidth shaping, transfers are queued on a single pipe
+	shapeLock sync.Mutex
+	pipeFree  time.Time
+}
+
+type storageError struct {
+	XMLName xml.Name `xml:"Error"`
+	Code    string   `xml:"Code"`
+	Message string   `xml:"Message"`
+}
+
+type pageRange struct {
+	Start int64 `xml:"Start"`
+	End   int64 `xml:"End"`
+}
+
+type pageList struct {
+	XMLName    xml.Name    `xml:"PageList"`
+	PageRanges []pageRange `xml:"PageRange"`
+}
+
+func newId() string {
+	b := make([]byte, 16)
+	rand.Read(b)
+	return fmt.Sprintf("%x-%x-%x-%x-%x", b[0:4], b[4:6], b[6:8], b[8:10], b[10:])
+}
+
+func writeError(w http.ResponseWriter, status int, code string, message string) {
+	out, _ := xml.Marshal(storageError{Code: code, Message: message})
+	w.Header().Set("Content-Type", "application/xml")
+	w.Header().Set("Content-Length", strconv.Itoa(len(out)))
+	w.WriteHeader(status)
+	w.Write(out)
+}
+
+// waits until bytes can go through the shared pipe
+func (e *emulator) shape(bytes int64) {
+	if 0 == *bandwidthMBps || 0 == bytes {
+		return
+	}
+
+	took := time.Duration(bytes * int64(time.Second) / (int64(*bandwidthMBps) << 20))
+	e.shapeLock.Lock()
+	now := time.Now()
+	if e.pipeFree.Before(now) {
+		e.pipeFree = now
+	}
+	e.pipeFree = e.pipeFree.Add(took)
+	done := e.pipeFree
+	e.shapeLock.Unlock()
+
+	time.Sleep(time.Until(done))
+}
+
+// parses x-ms-range (or Range) bytes=start-end
+func parseRange(r *http.Request) (int64, int64, bool, error) {
+	value := r.Header.Get("x-ms-range")
+	if "" == value {
+		value = r.Header.Get("Range")
+	}
+	if "" == value {
+		return 0, 0, false, nil
+	}
+
+	var start, end int64
+	if _, err := fmt.Sscanf(value, "bytes=%d-%d", &start, &end); nil != err || start > end {
+		return 0, 0, false, fmt.Errorf("invalid range %s", value)
+	}
+	return start, end, true, nil
+}
+
+// checks lease of blob against request, returns false if the request was failed
+func (e *emulator) checkLease(w http.ResponseWriter, r *http.Request, blob string, required bool) bool {
+	e.lock.Lock()
+	l := e.leases[blob]
+	e.lock.Unlock()
+
+	given := r.Header.Get("x-ms-lease-id")
+	if nil == l {
+		if "" != given {
+			writeError(w, http.StatusPreconditionFailed, "LeaseNotPresentWithBlobOperation", "There is currently no lease on the blob.")
+			return false
+		}
+		return true
+	}
+
+	if given == l.id {
+		return true
+	}
+
+	if "" == given && !required {
+		return true
+	}
+
+	writeError(w, http.StatusPreconditionFailed, "LeaseIdMismatchWithBlobOperation", "The lease ID specified did not match the lease ID for the blob.")
+	return false
+}
+
+func (e *emulator) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	start := time.Now()
+	w.Header().Set("x-ms-request-id", newId())
+	w.Header().Set("x-ms-version", "2017-04-17")
+
+	if 0 != *latency {
+		time.Sleep(*latency)
+	}
+
+	parts := strings.SplitN(strings.TrimPrefix(filepath.Clean("/"+r.URL.Path), "/"), "/", 2)
+	query := r.URL.Query()
+
+	switch {
+	case "" == parts[0]:
+		writeError(w, http.StatusBadRequest, "InvalidUri", "container name is required")
+	case 1 == len(parts) || "container" == query.Get("restype"):
+		e.container(w, r, parts[0])
+	default:
+		e.blob(w, r, parts[0], parts[1])
+	}
+
+	if *verbose {
+		log.Printf("%s %s %s %v", r.Method, r.URL.Path, r.Header.Get("x-ms-range"), time.Since(start))
+	}
+}
+
+func (e *emulator) container(w http.ResponseWriter, r *http.Request, name string) {
+	dir := filepath.Join(e.root, name)
+
+	switch r.Method {
+	case http.MethodPut:
+		if err := os.Mkdir(dir, 0755); nil != err {
+			if os.IsExist(err) {
+				writeError(w, http.StatusConflict, "ContainerAlreadyExists", "The specified container already exists.")
+				return
+			}
+			writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+			return
+		}
+		w.WriteHeader(http.StatusCreated)
+	case http.MethodGet, http.MethodHead:
+		if _, err := os.Stat(dir); nil != err {
+			writeError(w, http.StatusNotFound, "ContainerNotFound", "The specified container does not exist.")
+			return
+		}
+		w.WriteHeader(http.StatusOK)
+	case http.MethodDelete:
+		if err := os.RemoveAll(dir); nil != err {
+			writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+			return
+		}
+		w.WriteHeader(http.StatusAccepted)
+	default:
+		writeError(w, http.StatusMethodNotAllowed, "UnsupportedHttpVerb", r.Method)
+	}
+}
+
+func (e *emulator) blob(w http.ResponseWriter, r *http.Request, container string, name string) {
+	file := filepath.Join(e.root, container, name)
+	blob := container + "/" + name
+	comp := r.URL.Query().Get("comp")
+
+	if _, err := os.Stat(filepath.Join(e.root, container)); nil != err {
+		writeError(w, http.StatusNotFound, "ContainerNotFound", "The specified container does not exist.")
+		return
+	}
+
+	// only create works on missing blobs
+	info, err := os.Stat(file)
+	if nil != err && !(http.MethodPut == r.Method && "" == comp) {
+		writeError(w, http.StatusNotFound, "BlobNotFound", "The specified blob does not exist.")
+		return
+	}
+
+	switch {
+	case http.MethodPut == r.Method && "" == comp:
+		e.createBlob(w, r, file, blob)
+	case http.MethodPut == r.Method && "page" == comp:
+		e.putPage(w, r, file, blob, info.Size())
+	case http.MethodPut == r.Method && "lease" == comp:
+		e.lease(w, r, blob)
+	case http.MethodGet == r.Method && "pagelist" == comp:
+		e.pageRanges(w, r, file, info.Size())
+	case (http.MethodHead == r.Method || http.MethodGet == r.Method) && ("" == comp || "properties" == comp) && !(http.MethodGet == r.Method && "" == comp):
+		e.properties(w, blob, info)
+	case http.MethodGet == r.Method && "" == comp:
+		e.getRange(w, r, file, blob, info.Size())
+	case http.MethodDelete == r.Method:
+		if !e.checkLease(w, r, blob, true) {
+			return
+		}
+		if err := os.Remove(file); nil != err {
+			writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+			return
+		}
+		e.lock.Lock()
+		delete(e.leases, blob)
+		e.lock.Unlock()
+		w.WriteHeader(http.StatusAccepted)
+	default:
+		writeError(w, http.StatusBadRequest, "UnsupportedQueryParameter", fmt.Sprintf("%s comp=%s", r.Method, comp))
+	}
+}
+
+func (e *emulator) createBlob(w http.ResponseWriter, r *http.Request, file string, blob string) {
+	if "PageBlob" != r.Header.Get("x-ms-blob-type") {
+		writeError(w, http.StatusBadRequest, "InvalidHeaderValue", "only page blobs are supported")
+		return
+	}
+
+	size, err := strconv.ParseInt(r.Header.Get("x-ms-blob-content-length"), 10, 64)
+	if nil != err || 0 != size%pageSize {
+		writeError(w, http.StatusBadRequest, "InvalidHeaderValue", "x-ms-blob-content-length must be 512 aligned")
+		return
+	}
+
+	if !e.checkLease(w, r, blob, true) {
+		return
+	}
+
+	f, err := os.OpenFile(file, os.O_CREATE|os.O_WRONLY|os.O_TRUNC, 0644)
+	if nil != err {
+		writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+		return
+	}
+	defer f.Close()
+
+	// sparse, nothing is allocated until written
+	if err := f.Truncate(size); nil != err {
+		writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+		return
+	}
+
+	w.Header().Set("ETag", newId())
+	w.WriteHeader(http.StatusCreated)
+}
+
+func (e *emulator) putPage(w http.ResponseWriter, r *http.Request, file string, blob string, size int64) {
+	start, end, ok, err := parseRange(r)
+	if nil != err || !ok || 0 != start%pageSize || 0 != (end+1)%pageSize || end >= size {
+		writeError(w, http.StatusRequestedRangeNotSatisfiable, "InvalidPageRange", "The page range specified is invalid.")
+		return
+	}
+
+	if !e.checkLease(w, r, blob, true) {
+		return
+	}
+
+	f, err := os.OpenFile(file, os.O_WRONLY, 0644)
+	if nil != err {
+		writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+		return
+	}
+	defer f.Close()
+
+	length := end - start + 1
+	switch r.Header.Get("x-ms-page-write") {
+	case "update":
+		e.shape(length)
+		body := make([]byte, length)
+		if _, err := io.ReadFull(r.Body, body); nil != err {
+			writeError(w, http.StatusBadRequest, "InvalidInput", "body is shorter than range")
+			return
+		}
+		if _, err := f.WriteAt(body, start); nil != err {
+			writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+			return
+		}
+	case "clear":
+		if err := syscall.Fallocate(int(f.Fd()), fallocPunchHole|fallocKeepSize, start, length); nil != err {
+			// file system can't punch holes, write zeros
+			if _, err := f.WriteAt(make([]byte, length), start); nil != err {
+				writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+				return
+			}
+		}
+	default:
+		writeError(w, http.StatusBadRequest, "InvalidHeaderValue", "x-ms-page-write must be update or clear")
+		return
+	}
+
+	w.Header().Set("ETag", newId())
+	w.WriteHeader(http.StatusCreated)
+}
+
+func (e *emulator) getRange(w http.ResponseWriter, r *http.Request, file string, blob string, size int64) {
+	start, end, ok, err := parseRange(r)
+	if nil != err || start >= size {
+		writeError(w, http.StatusRequestedRangeNotSatisfiable, "InvalidRange", "The range specified is invalid for the current size of the resource.")
+		return
+	}
+	if !ok {
+		start, end = 0, size-1
+	}
+	if end >= size {
+		end = size - 1
+	}
+
+	if !e.checkLease(w, r, blob, false) {
+		return
+	}
+
+	f, err := os.Open(file)
+	if nil != err {
+		writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+		return
+	}
+	defer f.Close()
+
+	length := end - start + 1
+	e.shape(length)
+
+	status := http.StatusOK
+	if ok {
+		status = http.StatusPartialContent
+		w.Header().Set("Content-Range", fmt.Sprintf("bytes %d-%d/%d", start, end, size))
+	}
+	// dysk expects a content length, never chunked
+	w.Header().Set("Content-Length", strconv.FormatInt(length, 10))
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("x-ms-blob-type", "PageBlob")
+	w.WriteHeader(status)
+	io.Copy(w, io.NewSectionReader(f, start, length))
+}
+
+// walks data extents of the sparse file
+func (e *emulator) pageRanges(w http.ResponseWriter, r *http.Request, file string, size int64) {
+	from, to, ok, err := parseRange(r)
+	if nil != err {
+		writeError(w, http.StatusRequestedRangeNotSatisfiable, "InvalidRange", err.Error())
+		return
+	}
+	if !ok {
+		from, to = 0, size-1
+	}
+
+	f, err := os.Open(file)
+	if nil != err {
+		writeError(w, http.StatusInternalServerError, "InternalError", err.Error())
+		return
+	}
+	defer f.Close()
+
+	list := pageList{PageRanges: make([]pageRange, 0)}
+	for offset := from; offset <= to; {
+		data, err := f.Seek(offset, seekData)
+		if nil != err || data > to {
+			break // ENXIO: no data past offset
+		}
+		hole, err := f.Seek(data, seekHole)
+		if nil != err {
+			hole = size
+		}
+
+		first := data - data%pageSize
+		last := (hole+pageSize-1)/pageSize*pageSize - 1
+		if last > to {
+			last = to
+		}
+		list.PageRanges = append(list.PageRanges, pageRange{Start: first, End: last})
+		offset = last + 1
+	}
+
+	out, _ := xml.Marshal(list)
+	w.Header().Set("Content-Type", "application/xml")
+	w.Header().Set("Content-Length", strconv.Itoa(len(out)))
+	w.Header().Set("x-ms-blob-content-length", strconv.FormatInt(size, 10))
+	w.WriteHeader(http.StatusOK)
+	w.Write(out)
+}
+
+func (e *emulator) properties(w http.ResponseWriter, blob string, info os.FileInfo) {
+	e.lock.Lock()
+	l := e.leases[blob]
+	e.lock.Unlock()
+
+	state, status := "available", "unlocked"
+	if nil != l {
+		state, status = "leased", "locked"
+		w.Header().Set("x-ms-lease-duration", "infinite")
+	}
+
+	w.Header().Set("x-ms-blob-type", "PageBlob")
+	w.Header().Set("x-ms-lease-state", state)
+	w.Header().Set("x-ms-lease-status", status)
+	w.Header().Set("Content-Length", strconv.FormatInt(info.Size(), 10))
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("Last-Modified", info.ModTime().UTC().Format(http.TimeFormat))
+	w.Header().Set("ETag", fmt.Sprintf("\"%x\"", info.ModTime().UnixNano()))
+	w.WriteHeader(http.StatusOK)
+}
+
+// acquire, renew, change, release and break (breaks are immediate)
+func (e *emulator) lease(w http.ResponseWriter, r *http.Request, blob string) {
+	e.lock.Lock()
+	defer e.lock.Unlock()
+
+	l := e.leases[blob]
+	given := r.Header.Get("x-ms-lease-id")
+
+	switch r.Header.Get("x-ms-lease-action") {
+	case "acquire":
+		if nil != l && given != l.id {
+			writeError(w, http.StatusConflict, "LeaseAlreadyPresent", "There is already a lease present.")
+			return
+		}
+		id := r.Header.Get("x-ms-proposed-lease-id")
+		if "" == id {
+			id = newId()
+		}
+		e.leases[blob] = &lease{id: id}
+		w.Header().Set("x-ms-lease-id", id)
+		w.WriteHeader(http.StatusCreated)
+	case "renew":
+		if nil == l || given != l.id {
+			writeError(w, http.StatusConflict, "LeaseIdMismatchWithLeaseOperation", "The lease ID specified did not match the lease ID for the blob.")
+			return
+		}
+		w.Header().Set("x-ms-lease-id", l.id)
+		w.WriteHeader(http.StatusOK)
+	case "change":
+		if nil == l || given != l.id {
+			writeError(w, http.StatusConflict, "LeaseIdMismatchWithLeaseOperation", "The lease ID specified did not match the lease ID for the blob.")
+			return
+		}
+		l.id = r.Header.Get("x-ms-proposed-lease-id")
+		w.Header().Set("x-ms-lease-id", l.id)
+		w.WriteHeader(http.StatusOK)
+	case "release":
+		if nil == l || given != l.id {
+			writeError(w, http.StatusConflict, "LeaseIdMismatchWithLeaseOperation", "The lease ID specified did not match the lease ID for the blob.")
+			return
+		}
+		delete(e.leases, blob)
+		w.WriteHeader(http.StatusOK)
+	case "break":
+		if nil == l {
+			writeError(w, http.StatusConflict, "LeaseNotPresentWithLeaseOperation", "There is currently no lease on the blob.")
+			return
+		}
+		delete(e.leases, blob)
+		w.Header().Set("x-ms-lease-time", "0")
+		w.WriteHeader(http.StatusAccepted)
+	default:
+		writeError(w, http.StatusBadRequest, "InvalidHeaderValue", "x-ms-lease-action is invalid")
+	}
+}
+
+func main() {
+	flag.Parse()
+
+	if err := os.MkdirAll(*dataDir, 0755); nil != err {
+		log.Fatalf("failed to create data dir %s: %v", *dataDir, err)
+	}
+
+	e := &emulator{
+		root:   *dataDir,
+		leases: make(map[string]*lease),
+	}
+
+	log.Printf("page blob emulator on %s, data in %s (latency:%v bandwidth:%dMB/s)", *listen, *dataDir, *latency, *bandwidthMBps)
+	log.Fatal(http.ListenAndServe(*listen, e))
+}
@@ -8,11 +8,12 @@ key="$2"
 DYSKCTL="$3"
 DYSK_SIZE="$4"
 FIO_FILE="$5"
+MOUNT_FLAGS="${6:-}" # extra dysk mount flags (optional)
 
 sudo mkdir -p /mnt/dysk01
 
 echo "Adding an auto create disk 4 TB"
-device_name=$(sudo ${DYSKCTL} mount auto-create -a "${account}" -k "${key}" --size ${DYSK_SIZE} -o json | jq -r '.Name' || echo -n "")
+device_name=$(sudo ${DYSKCTL} mount auto-create -a "${account}" -k "${key}" --size ${DYSK_SIZE} ${MOUNT_FLAGS} -o json | jq -r '.Name' || echo -n "")
 
 if [[ -z "$device_name" ]]; then
   echo "Test failed"
@@ -0,0 +1,220 @@
+#!/bin/bash
+
+# Runs the fio matrix described in bench_matrix.json against raw dysks,
+# writes results (json) to ./results and compares them against a baseline.
+# exits 1 if any configuration regressed beyond tolerance.
+
+set -eo pipefail
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+V_SETTINGS=${V_SETTINGS:-"${DIR}/settings.json"}
+DYSKCTL="${DIR}/../../dyskctl/dyskctl"
+
+B_MATRIX="${DIR}/bench_matrix.json"
+B_BASELINE="${DIR}/baselines/default.json"
+B_RESULTS_DIR="${DIR}/results"
+B_TOLERANCE=10 # %
+B_SAVE_BASELINE=""
+
+B_DEVICES=()
+
+function usage()
+{
+  echo "usage: $0 [-m matrix.json] [-b baseline.json] [-t tolerance %] [-s]"
+  echo "  -s saves this run as the baseline instead of comparing against it"
+  exit 1
+}
+
+function ensure_ready()
+{
+  for tool in jq fio; do
+    if [[ "" == "$(which ${tool})" ]];then
+      echo "${tool} does not exist, please install ${tool}"
+      exit 1
+    fi
+  done
+
+  if [[ ! -f "${V_SETTINGS}" || ! -f "${B_MATRIX}" ]]; then
+    echo "settings file ${V_SETTINGS} or matrix file ${B_MATRIX} does not exist"
+    exit 1
+  fi
+
+  B_TRANSPORT="$(cat "${B_MATRIX}" | jq -r '.transport //"az"')"
+  V_ACCOUNT_NAME="$(cat "${V_SETTINGS}" | jq -r '.account //empty')"
+  V_ACCOUNT_KEY="$(cat "${V_SETTINGS}" | jq -r '.key //empty')"
+  V_REALM="$(cat "${V_SETTINGS}" | jq -r '.realm //empty')"
+
+  # in memory transports need no storage account
+  if [[ "az" == "${B_TRANSPORT}" ]] && [[ -z "${V_ACCOUNT_NAME}" || -z "${V_ACCOUNT_KEY}" ]]; then
+    echo "invalid account name or key"
+    exit 1
+  fi
+}
+
+function mount_dysks()
+{
+  local count="$1"
+  local size="$2"
+
+  for (( idx=1; idx<=${count}; idx++ ));
+  do
+    local device_name=$(sudo ${DYSKCTL} mount auto-create -a "${V_ACCOUNT_NAME}" -k "${V_ACCOUNT_KEY}" ${V_REALM:+--realm "${V_REALM}"} --transport "${B_TRANSPORT}" --size ${size} -o json | jq -r '.Name' || echo -n "")
+    if [[ -z "${device_name}" ]]; then
+      echo "failed to mount dysk ${idx}/${count}"
+      exit 1
+    fi
+    B_DEVICES+=("${device_name}")
+  done
+  echo "mounted: ${B_DEVICES[*]}"
+}
+
+function unmount_dysks()
+{
+  for device_name in "${B_DEVICES[@]}"
+  do
+    sudo ${DYSKCTL} unmount -d "${device_name}" || echo "failed to unmount ${device_name}"
+  done
+  B_DEVICES=()
+}
+
+# cpu ticks used so far by all dysk worker (send + receive) threads
+function worker_ticks()
+{
+  awk '$2 ~ /^\(dysk-(worker|rx)-/ { t += $14 + $15 } END { print t + 0 }' /proc/[0-9]*/stat 2>/dev/null || echo 0
+}
+
+# runs one configuration, prints one result (json)
+function run_one()
+{
+  local id="$1" bs="$2" rw="$3" mix="$4" qd="$5" runtime="$6" ramp="$7"
+  local jobs=()
+
+  for device_name in "${B_DEVICES[@]}"
+  do
+    jobs+=(--name="${device_name}" --filename="/dev/${device_name}")
+  done
+
+  local ticks_before=$(worker_ticks)
+  local out=$(sudo fio --output-format=json --percentile_list=50:99:99.9 \
+                       --direct=1 --ioengine=libaio --time_based=1 --group_reporting=1 \
+                       --runtime=${runtime} --ramp_time=${ramp} \
+                       --bs=${bs} --rw=${rw} ${mix:+--rwmixread=${mix}} --iodepth=${qd} \
+                       "${jobs[@]}")
+  local ticks_after=$(worker_ticks)
+
+  # percent of one cpu, over the whole run (ramp included)
+  local cpu=$(( (ticks_after - ticks_before) * 100 / ($(getconf CLK_TCK) * (runtime + ramp)) ))
+
+  # mixed workloads: iops/bw are summed, latency is the worse of read and write
+  echo "${out}" | jq -c --arg id "${id}" --arg bs "${bs}" --arg rw "${rw}" \
+                        --argjson qd ${qd} --argjson dysks ${#B_DEVICES[@]} --argjson cpu ${cpu} '
+    .jobs[0] as $j |
+    ([$j.read, $j.write] | map(select(.io_bytes > 0))) as $dirs |
+    def pct(p): ($dirs | map(.clat_ns.percentile[p] // 0) | max // 0) / 1000 | floor;
+    {
+      id: $id, bs: $bs, rw: $rw, qd: $qd, dysks: $dysks,
+      iops: ($j.read.iops + $j.write.iops | floor),
+      bw_kib: ($j.read.bw + $j.write.bw),
+      lat_p50_us: pct("50.000000"),
+      lat_p99_us: pct("99.000000"),
+      lat_p999_us: pct("99.900000"),
+      worker_cpu_pct: $cpu,
+      errors: ($j.error)
+    }'
+}
+
+function run_matrix()
+{
+  local results_file="$1"
+  local lines_file="${results_file}.lines"
+  local size="$(jq -r '.size_gb' "${B_MATRIX}")"
+  local runtime="$(jq -r '.runtime_secs' "${B_MATRIX}")"
+  local ramp="$(jq -r '.ramp_secs' "${B_MATRIX}")"
+
+  : > "${lines_file}"
+  for dysks in $(jq -r '.dysks[]' "${B_MATRIX}")
+  do
+    mount_dysks "${dysks}" "${size}"
+    for bs in $(jq -r '.block_sizes[]' "${B_MATRIX}")
+    do
+      for workload in $(jq -c '.workloads[]' "${B_MATRIX}")
+      do
+        local name="$(echo -n "${workload}" | jq -r '.name')"
+        local rw="$(echo -n "${workload}" | jq -r '.rw')"
+        local mix="$(echo -n "${workload}" | jq -r '.rwmixread //empty')"
+        for qd in $(jq -r '.queue_depths[]' "${B_MATRIX}")
+        do
+          local id="${name}-${bs}-qd${qd}-d${dysks}"
+          echo "==> ${id}"
+          run_one "${id}" "${bs}" "${rw}" "${mix}" "${qd}" "${runtime}" "${ramp}" | tee -a "${lines_file}"
+        done
+      done
+    done
+    unmount_dysks
+  done
+
+  jq -s --arg kernel "$(uname -r)" --arg realm "${V_REALM:-core.windows.net}" --arg transport "${B_TRANSPORT}" \
+        --arg created "$(date -u +%Y-%m-%dT%H:%M:%SZ)" --slurpfile matrix "${B_MATRIX}" \
+        '{ created: $created, kernel: $kernel, realm: $realm, transport: $transport, matrix: $matrix[0], results: . }' \
+        "${lines_file}" > "${results_file}"
+  rm -f "${lines_file}"
+  echo "results: ${results_file}"
+}
+
+# configurations missing from either side are skipped
+function compare()
+{
+  local results_file="$1"
+
+  if [[ ! -f "${B_BASELINE}" ]]; then
+    echo "no baseline at ${B_BASELINE}, run with -s to create one"
+    return 0
+  fi
+
+  local report=$(jq -r -n --slurpfile base "${B_BASELINE}" --slurpfile cur "${results_file}" --argjson tol ${B_TOLERANCE} '
+    ($base[0].results | map({ key: .id, value: . }) | from_entries) as $b |
+    def delta(c; o): if 0 == o then 0 else ((c - o) * 100 / o | floor) end;
+    $cur[0].results[] | select(null != $b[.id]) | . as $c | $b[.id] as $o |
+    ((($c.iops < $o.iops * (1 - $tol / 100)) or
+      ($c.bw_kib < $o.bw_kib * (1 - $tol / 100)) or
+      ($c.lat_p99_us > $o.lat_p99_us * (1 + $tol / 100)) or
+      ($c.lat_p999_us > $o.lat_p999_us * (1 + $tol / 100))) | if . then "REGRESSED" else "ok" end) as $verdict |
+    [$c.id, "\(delta($c.iops; $o.iops))%", "\(delta($c.bw_kib; $o.bw_kib))%",
+     "\(delta($c.lat_p99_us; $o.lat_p99_us))%", "\(delta($c.lat_p999_us; $o.lat_p999_us))%", $verdict] | @tsv')
+
+  (echo -e "CONFIG\tIOPS\tBW\tP99\tP99.9\tVERDICT"; echo "${report}") | column -t -s $'\t'
+
+  local regressed=$(echo "${report}" | grep -c "REGRESSED" || true)
+  if [[ "0" != "${regressed}" ]]; then
+    echo "${regressed} configuration(s) regressed more than ${B_TOLERANCE}% against ${B_BASELINE}"
+    return 1
+  fi
+  echo "no regressions against ${B_BASELINE} (tolerance ${B_TOLERANCE}%)"
+}
+
+# START HERE
+while getopts "m:b:t:sh" opt; do
+  case "${opt}" in
+    m) B_MATRIX="${OPTARG}" ;;
+    b) B_BASELINE="${OPTARG}" ;;
+    t) B_TOLERANCE="${OPTARG}" ;;
+    s) B_SAVE_BASELINE="1" ;;
+    *) usage ;;
+  esac
+done
+
+ensure_ready
+trap unmount_dysks EXIT
+
+mkdir -p "${B_RESULTS_DIR}"
+results_file="${B_RESULTS_DIR}/$(date -u +%Y%m%d-%H%M%S).json"
+run_matrix "${results_file}"
+
+if [[ -n "${B_SAVE_BASELINE}" ]]; then
+  mkdir -p "$(dirname "${B_BASELINE}")"
+  cp "${results_file}" "${B_BASELINE}"
+  echo "saved baseline: ${B_BASELINE}"
+  exit 0
+fi
+
+compare "${results_file}"
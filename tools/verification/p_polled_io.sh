@@ -0,0 +1,14 @@
+#!/bin/bash
+
+set -eo pipefail
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+account="$1"
+key="$2"
+DYSKCTL="$3"
+
+echo "qd1 latency, interrupt driven dysk"
+"${DIR}"/__run_perf_test.sh "${account}" "${key}" ${DYSKCTL} "4096" "${DIR}/latency.fio"
+
+echo "qd1 latency, polled dysk"
+"${DIR}"/__run_perf_test.sh "${account}" "${key}" ${DYSKCTL} "4096" "${DIR}/latency.fio" "--poll-us 500"
@@ -0,0 +1,58 @@
+#!/bin/bash
+
+set -eo pipefail
+account="$1"
+key="$2"
+DYSKCTL="$3"
+
+# requests that get no response for longer than worker task timeout (300s)
+# must fail with -EAGAIN and be counted in timeouts. Responses are held
+# back with fault injection (needs debugfs mounted)
+delay_ms=310000
+
+echo "Adding an auto create disk 4 gb"
+dysk_json="$(sudo ${DYSKCTL} mount auto-create -a "${account}" -k "${key}" --size 4 -o json)"
+device_name="$(echo "$dysk_json" | jq -r '.Name //empty')"
+
+if [[ -z "$device_name" ]]; then
+  echo "Test failed"
+  exit 1
+fi
+
+echo "Added deviceName:$device_name"
+faults="/sys/kernel/debug/dysk/${device_name}/faults"
+stats="/sys/block/${device_name}/dysk"
+
+if ! sudo test -d "${faults}"; then
+  echo "Test failed: ${faults} does not exist (is debugfs mounted?)"
+  sudo ${DYSKCTL} unmount -d "$device_name"
+  exit 1
+fi
+
+timeouts_before="$(cat ${stats}/timeouts)"
+echo "holding every response for ${delay_ms}ms"
+echo ${delay_ms} | sudo tee ${faults}/delay_ms > /dev/null
+echo 1 | sudo tee ${faults}/delay_every > /dev/null
+
+echo "reading 4k from /dev/${device_name}, expected to fail once request times out"
+if sudo dd if=/dev/${device_name} of=/dev/null bs=4k count=1 iflag=direct; then
+  echo "Test failed: read succeeded, expected a time out"
+  result=1
+else
+  result=0
+fi
+
+echo 0 | sudo tee ${faults}/delay_every > /dev/null
+timeouts_after="$(cat ${stats}/timeouts)"
+
+if [[ "${timeouts_after}" -le "${timeouts_before}" ]]; then
+  echo "Test failed: timeouts did not grow (before:${timeouts_before} after:${timeouts_after})"
+  result=1
+else
+  echo "timeouts: ${timeouts_before} -> ${timeouts_after}"
+fi
+
+echo "Removing deviceName:$device_name"
+sudo ${DYSKCTL} unmount -d "$device_name"
+
+exit ${result}
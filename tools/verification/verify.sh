@@ -79,9 +79,11 @@ add_test "mount read only" "v_mount_ro.sh" "VERIFY"
 add_test "Add, format, remove, add another" "v_add_format_remove_add.sh" "VERIFY"
 add_test "add remove 128 dysks" "v_add_remove_128dysks.sh" "VERIFY"
 add_test "Add/Format/Remove 10 dysks" "v_add_format_remove_10dysks.sh" "VERIFY"
+add_test "Timed out request fails with EAGAIN" "v_request_timeout.sh" "VERIFY"
 
 #perf tests
 #add_test "Basic perf tests" "p_basic_io.sh" "PERF"
+add_test "Polled vs interrupt driven latency" "p_polled_io.sh" "PERF"
 
 
 # START HERE